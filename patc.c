@@ -1,17 +1,44 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define PATC_IO_URING
+#endif
+#endif
+#endif // __linux__
+
 #define CCLI_IMPLEMENTATION
 #include "ccli.h"
 
 #define NOB_IMPLEMENTATION
 #include "nob.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define PATC_X86_SIMD
+#endif
+
 #define parser_report_error(p, msg, ...)                                                                     \
     do {                                                                                                     \
-        fprintf(stderr, "Error: %s:%zu: " msg "\n", (p)->filename, (p)->cursor - (p)->input, ##__VA_ARGS__); \
+        fprintf(stderr, "Error: %s:%zu: " msg "\n", (p)->filename, cursor_offset(p), ##__VA_ARGS__);        \
         exit(1);                                                                                             \
     } while (0)
 
@@ -26,6 +53,20 @@
 
 static char patch_file[CCLI_MAX_STR_LEN];
 static bool nowrite;
+static bool scalar;
+static bool sequential;
+static long jobs;
+static bool atomic;
+static char durability_arg[CCLI_MAX_STR_LEN] = "none";
+static char io_arg[CCLI_MAX_STR_LEN] = "auto";
+static bool drop_cache;
+static long queue_depth;
+static bool stream;
+static char max_memory_arg[CCLI_MAX_STR_LEN];
+static char write_arg[CCLI_MAX_STR_LEN] = "rewrite";
+static bool transaction;
+static char backup[CCLI_MAX_STR_LEN] = "copy";
+static char store[CCLI_MAX_STR_LEN] = ".patc-store";
 
 ccli_commands(commands,
               {"apply", "Apply a .patc files"},
@@ -34,21 +75,250 @@ ccli_commands(commands,
 
 ccli_options(options,
              ccli_option_string_var_p(patch_file, "The patch to apply", "patchfile", true, true, ccli_scope_global()),
-             ccli_option_bool_var(nowrite, "Only print subtitutions", false, false, ccli_scope_subcmd(0)));
+             ccli_option_bool_var(nowrite, "Only print subtitutions", false, false, ccli_scope_subcmd(0)),
+             ccli_option_bool_var(scalar, "Disable the SIMD candidate filter when matching", false, false, ccli_scope_subcmd(0)),
+             ccli_option_bool_var(sequential, "Apply the rules for a file one after another instead of in a single pass", false, false, ccli_scope_subcmd(0)),
+             ccli_option_int_var_p(jobs, "Number of files patched or restored in parallel. Defaults to the number of online CPUs", "N", false, false, ccli_scope_global()),
+             ccli_option_bool_var(atomic, "Write patched files to a temporary file and rename it over the original", false, false, ccli_scope_subcmd(0)),
+             ccli_option_bool_var(stream, "Patch files a chunk at a time instead of reading them whole", false, false, ccli_scope_subcmd(0)),
+             ccli_option_string("max-memory", max_memory_arg, "Bytes of a file a job holds in memory, larger files are streamed. Takes a K, M or G suffix", "size", false, false, ccli_scope_subcmd(0)),
+             ccli_option_string("write", write_arg, "How patched files are written: rewrite, inplace for rules which keep the size, tail or minimal", "mode", false, false, ccli_scope_subcmd(0)),
+             ccli_option_bool_var(transaction, "Replace the patched files all at once at the end, or none of them if one fails", false, false, ccli_scope_subcmd(0)),
+             ccli_option_string("durability", durability_arg, "When patched files are flushed to disk: none, file by file, or batch once at the end", "mode", false, false, ccli_scope_subcmd(0)),
+             ccli_option_bool("drop-cache", drop_cache, "Drop patched files from the page cache once they are written back", false, false, ccli_scope_subcmd(0)),
+             ccli_option_int("queue-depth", queue_depth, "Files between reading and writing in a pipeline of a reader, --jobs matchers and a writer. 0 lets every job read, match and write its files", "N", false, false, ccli_scope_subcmd(0)),
+             ccli_option_string("io", io_arg, "How small files are read and written: auto, uring or posix", "backend", false, false, ccli_scope_subcmd(0)),
+             ccli_option_string_var(backup, "How patched files are backed up and restored: copy, link, store or none", "mode", false, false, ccli_scope_global()),
+             ccli_option_string_var(store, "Directory of the content addressed backup store used by --backup store", "dir", false, false, ccli_scope_global()));
+
+// Parsed --max-memory, 0 if files are not limited
+static size_t max_memory;
+
+void select_max_memory(void) {
+    if (max_memory_arg[0] == '\0') {
+        return;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(max_memory_arg, &end, 10);
+    static const char suffixes[] = "KMG";
+    unsigned shift = 0;
+    const char *suffix = strchr(suffixes, *end);
+    if (*end != '\0' && suffix != NULL) {
+        shift = 10 * (unsigned)(suffix - suffixes + 1);
+        end++;
+    }
+    if (errno != 0 || end == max_memory_arg || *end != '\0' || size == 0 || size > (SIZE_MAX >> shift)) {
+        report_error("invalid --max-memory %s, expected a size like 65536, 512K or 64M", max_memory_arg);
+    }
+    max_memory = (size_t)size << shift;
+}
+
+typedef enum {
+    DURABILITY_NONE,
+    DURABILITY_FILE,  // every file is flushed before it replaces the original
+    DURABILITY_BATCH, // every file system is flushed once all files are written, then the
+                      // files replace the originals and the file systems are flushed again
+} durability_mode;
+
+static durability_mode selected_durability = DURABILITY_NONE;
+
+void select_durability(void) {
+    if (strcmp(durability_arg, "none") == 0) {
+        selected_durability = DURABILITY_NONE;
+    } else if (strcmp(durability_arg, "file") == 0) {
+        selected_durability = DURABILITY_FILE;
+    } else if (strcmp(durability_arg, "batch") == 0) {
+        selected_durability = DURABILITY_BATCH;
+    } else {
+        report_error("unknown durability %s, expected none, file or batch", durability_arg);
+    }
+}
+
+// Drops len bytes of a file just written from the page cache, up to the end of the file if
+// len is 0. Only clean pages can be dropped, so the bytes are written back first.
+void drop_written(int fd, off_t offset, off_t len) {
+#ifdef __linux__
+    sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+    fdatasync(fd);
+#endif // __linux__
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+// Finishes writing a file. It is flushed if every file is flushed on its own and dropped
+// from the page cache with --drop-cache.
+bool sync_file(int fd) {
+    if (selected_durability == DURABILITY_FILE && fdatasync(fd) < 0) {
+        return false;
+    }
+    if (drop_cache) {
+        drop_written(fd, 0, 0);
+    }
+    return true;
+}
+
+typedef enum {
+    IO_POSIX,
+    IO_URING, // small files are read and written through an io_uring of every job
+} io_backend;
+
+static io_backend selected_io = IO_POSIX;
+
+typedef enum {
+    WRITE_REWRITE,
+    WRITE_INPLACE, // only the changed bytes are written if no rule changes the size
+    WRITE_TAIL,    // only the file after the first change is written
+    WRITE_MINIMAL, // like tail, or the rest of the file is shifted where that writes less
+} write_mode;
+
+static write_mode selected_write = WRITE_REWRITE;
+
+void select_write_mode(void) {
+    if (strcmp(write_arg, "rewrite") == 0) {
+        selected_write = WRITE_REWRITE;
+    } else if (strcmp(write_arg, "inplace") == 0) {
+        selected_write = WRITE_INPLACE;
+    } else if (strcmp(write_arg, "tail") == 0) {
+        selected_write = WRITE_TAIL;
+    } else if (strcmp(write_arg, "minimal") == 0) {
+        selected_write = WRITE_MINIMAL;
+    } else {
+        report_error("unknown write mode %s, expected rewrite, inplace, tail or minimal", write_arg);
+    }
+}
+
+typedef enum {
+    BACKUP_COPY,
+    BACKUP_LINK,  // the original inode is hard linked as backup and the patched file renamed over it
+    BACKUP_STORE, // the original is kept once per content in the store and listed in its manifest
+    BACKUP_NONE,
+} backup_mode;
+
+static backup_mode selected_backup = BACKUP_COPY;
+
+void select_backup_mode(void) {
+    if (strcmp(backup, "copy") == 0) {
+        selected_backup = BACKUP_COPY;
+    } else if (strcmp(backup, "link") == 0) {
+        selected_backup = BACKUP_LINK;
+    } else if (strcmp(backup, "store") == 0) {
+        selected_backup = BACKUP_STORE;
+    } else if (strcmp(backup, "none") == 0) {
+        selected_backup = BACKUP_NONE;
+    } else {
+        report_error("unknown backup mode %s, expected copy, link, store or none", backup);
+    }
+}
+
+#define MATCH_NONE SIZE_MAX
 
+// Substring search state for a single needle. Built once per rule and reused for every
+// search over every input. The search is the Two-Way algorithm (Crochemore-Perrin) which is
+// linear in the worst case, combined with a Horspool bad character shift on the last byte
+// of the window which makes it sublinear on typical input.
 typedef struct {
-    Nob_String_View *items;
-    size_t count;
-    size_t capacity;
-} files;
+    Nob_String_View needle;
+    size_t shift[256]; // last index + 1 of every byte in the needle, 0 if the byte is absent
+    size_t ms;         // critical factorization position, SIZE_MAX for single byte needles
+    size_t p;          // shift applied after the left half was compared
+    size_t mem0;       // prefix remembered across shifts for periodic needles
+} matcher;
+
+typedef enum {
+    MATCH_ISA_SCALAR,
+    MATCH_ISA_SSE2,
+    MATCH_ISA_AVX2,
+} match_isa;
+
+static match_isa selected_isa = MATCH_ISA_SCALAR;
 
 typedef struct {
     Nob_String_View filename;
 
     Nob_String_View to_match;
     Nob_String_View to_replace;
+
+    matcher matcher;
 } patc;
 
+// A match of a rule at an offset of the buffer the rule was applied to
+typedef struct {
+    size_t offset;
+    const patc *rule;
+} edit;
+
+typedef struct {
+    edit *items;
+    size_t count;
+    size_t capacity;
+} edits;
+
+// The rules of a patch file which target the same file, in declaration order, together with
+// the state of patching that file. Targets are patched in parallel, so everything a worker
+// has to say about a target goes into its log and output and is printed in target order.
+typedef struct {
+    Nob_String_View filename;
+    const patc **items;
+    size_t count;
+    size_t capacity;
+
+    const char *path;
+    Nob_String_Builder log;    // printed to stderr
+    Nob_String_Builder output; // printed to stdout
+    size_t matches;            // over all rules, 0 if the file is unchanged
+    uint64_t written;          // bytes written to the file
+    char stored[65];           // hash of the original in the backup store, empty if not stored
+    bool missing;              // no backup to restore from
+    bool failed;
+    bool staged;   // patched file waits in <file>.patc-new for the transaction to commit
+    char *pending; // patched file waiting to be renamed over the file with batched durability
+    dev_t dev;
+    bool done;
+} target;
+
+// Open addressing index from file names to targets. Slots hold the target index + 1, 0 marks
+// an empty slot.
+typedef struct {
+    size_t *slots;
+    size_t capacity;
+} target_index;
+
+typedef struct {
+    target *items;
+    size_t count;
+    size_t capacity;
+    target_index index;
+} targets;
+
+// Aho-Corasick automaton over the rules of a target. The root has a dense transition table,
+// every other node keeps its children in a sibling list since they rarely have more than one.
+typedef struct {
+    uint32_t child;   // first child, 0 if none
+    uint32_t sibling; // next child of the same parent, 0 if none
+    uint32_t fail;    // node of the longest proper suffix which is also in the trie
+    uint32_t out;     // nearest node on the fail chain which ends a rule, 0 if none
+    uint32_t depth;
+    uint32_t rule;    // index of the rule ending here in the target, UINT32_MAX if none
+    unsigned char byte;
+} ac_node;
+
+typedef struct {
+    ac_node *items;
+    size_t count;
+    size_t capacity;
+
+    uint32_t root[256];
+    const target *t;
+    size_t *hits; // number of matches per rule of the target
+} ac_automaton;
+
+typedef struct {
+    uint32_t *items;
+    size_t count;
+    size_t capacity;
+} ac_queue;
+
 typedef struct {
     patc *items;
     size_t count;
@@ -185,124 +455,3232 @@ void parse_file(parser *p, patches *ps) {
     parser_expect_eof(p);
 }
 
-bool match_content(const char *start, Nob_String_View to_match) {
-    while (to_match.count > 0) {
-        if (*start != *to_match.data) {
-            break;
+static size_t matcher_max_suffix(Nob_String_View n, bool reverse, size_t *period) {
+    const unsigned char *s = (const unsigned char *)n.data;
+    size_t ip = SIZE_MAX;
+    size_t jp = 0;
+    size_t k = 1;
+    size_t p = 1;
+    while (jp + k < n.count) {
+        unsigned char a = s[ip + k];
+        unsigned char b = s[jp + k];
+        if (a == b) {
+            if (k == p) {
+                jp += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (reverse ? a < b : a > b) {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        } else {
+            ip = jp++;
+            k = p = 1;
         }
-        start++;
-        to_match.data++;
-        to_match.count--;
     }
-    return to_match.count == 0;
+    *period = p;
+    return ip;
 }
 
-void apply_patc(patc patch, Nob_String_Builder *in, Nob_String_Builder *out) {
-    if (patch.to_match.count == 0) {
+void matcher_init(matcher *m, Nob_String_View needle) {
+    memset(m, 0, sizeof(*m));
+    m->needle = needle;
+    if (needle.count == 0) {
         return;
     }
-    if (patch.to_match.count > in->count) {
+
+    for (size_t i = 0; i < needle.count; ++i) {
+        m->shift[(unsigned char)needle.data[i]] = i + 1;
+    }
+
+    size_t p0, p1;
+    size_t ms = matcher_max_suffix(needle, false, &p0);
+    size_t ms1 = matcher_max_suffix(needle, true, &p1);
+    size_t p = p0;
+    if (ms1 + 1 > ms + 1) {
+        ms = ms1;
+        p = p1;
+    }
+
+    if (memcmp(needle.data, needle.data + p, ms + 1) != 0) {
+        m->mem0 = 0;
+        m->p = (ms > needle.count - ms - 1 ? ms : needle.count - ms - 1) + 1;
+    } else {
+        m->mem0 = needle.count - p;
+        m->p = p;
+    }
+    m->ms = ms;
+}
+
+void select_match_isa(bool force_scalar) {
+    selected_isa = MATCH_ISA_SCALAR;
+#ifdef PATC_X86_SIMD
+    if (force_scalar) {
         return;
     }
-    bool found_any = false;
-    for (size_t i = 0; i < in->count; ++i) {
-        if (in->items[i] != *patch.to_match.data || !match_content(in->items + i, patch.to_match)) {
-            nob_da_append(out, in->items[i]);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        selected_isa = MATCH_ISA_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        selected_isa = MATCH_ISA_SSE2;
+    }
+#else
+    NOB_UNUSED(force_scalar);
+#endif // PATC_X86_SIMD
+}
+
+#ifdef PATC_X86_SIMD
+// The SIMD filters test the first and the last byte of the needle at 16/32 positions at
+// once and only compare the rest of the needle for the positions where both match. On
+// repetitive input nearly every position can be a candidate, so the filter gives up once
+// verifying candidates costs more than scanning and lets the Two-Way search take over.
+#define SIMD_VERIFY_BUDGET(scanned) (4 * (scanned) + 4096)
+
+__attribute__((target("sse2"))) static bool matcher_filter_sse2(const matcher *m, const char *hay, size_t len, size_t *from) {
+    const char *n = m->needle.data;
+    size_t l = m->needle.count;
+    const __m128i first = _mm_set1_epi8(n[0]);
+    const __m128i last = _mm_set1_epi8(n[l - 1]);
+    size_t start = *from;
+    size_t i = start;
+    size_t verified = 0;
+    while (i + l - 1 + 16 <= len) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + l - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            size_t pos = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(hay + pos + 1, n + 1, l - 2) == 0) {
+                *from = pos;
+                return true;
+            }
+            verified += l;
+            mask &= mask - 1;
+        }
+        i += 16;
+        if (verified > SIMD_VERIFY_BUDGET(i - start)) {
+            break;
+        }
+    }
+    *from = i;
+    return false;
+}
+
+__attribute__((target("avx2"))) static bool matcher_filter_avx2(const matcher *m, const char *hay, size_t len, size_t *from) {
+    const char *n = m->needle.data;
+    size_t l = m->needle.count;
+    const __m256i first = _mm256_set1_epi8(n[0]);
+    const __m256i last = _mm256_set1_epi8(n[l - 1]);
+    size_t start = *from;
+    size_t i = start;
+    size_t verified = 0;
+    while (i + l - 1 + 32 <= len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + l - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            size_t pos = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(hay + pos + 1, n + 1, l - 2) == 0) {
+                *from = pos;
+                return true;
+            }
+            verified += l;
+            mask &= mask - 1;
+        }
+        i += 32;
+        if (verified > SIMD_VERIFY_BUDGET(i - start)) {
+            break;
+        }
+    }
+    *from = i;
+    return false;
+}
+#endif // PATC_X86_SIMD
+
+// Returns the offset of the first occurrence of the needle in hay[from..len) or MATCH_NONE.
+size_t matcher_find(const matcher *m, const char *hay, size_t len, size_t from) {
+    const unsigned char *n = (const unsigned char *)m->needle.data;
+    size_t l = m->needle.count;
+    if (l == 0 || from > len || len - from < l) {
+        return MATCH_NONE;
+    }
+    if (l == 1) {
+        const char *found = memchr(hay + from, n[0], len - from);
+        return found == NULL ? MATCH_NONE : (size_t)(found - hay);
+    }
+
+#ifdef PATC_X86_SIMD
+    // The filters stop at the tail of the input or when they give up. In both cases the
+    // Two-Way search below continues from where they stopped.
+    if (selected_isa == MATCH_ISA_AVX2 && matcher_filter_avx2(m, hay, len, &from)) {
+        return from;
+    }
+    if (selected_isa == MATCH_ISA_SSE2 && matcher_filter_sse2(m, hay, len, &from)) {
+        return from;
+    }
+#endif // PATC_X86_SIMD
+
+    const unsigned char *h = (const unsigned char *)hay + from;
+    const unsigned char *z = (const unsigned char *)hay + len;
+    size_t mem = 0;
+    while ((size_t)(z - h) >= l) {
+        size_t k = l - m->shift[h[l - 1]];
+        if (k != 0) {
+            h += k;
+            mem = 0;
+            continue;
+        }
+
+        for (k = m->ms + 1 > mem ? m->ms + 1 : mem; k < l && n[k] == h[k]; k++) {
+        }
+        if (k < l) {
+            h += k - m->ms;
+            mem = 0;
             continue;
         }
-        found_any = true;
-        nob_sb_append_buf(out, patch.to_replace.data, patch.to_replace.count);
-        i += patch.to_match.count;
-        nob_da_append(out, in->items[i]);
+
+        for (k = m->ms + 1; k > mem && n[k - 1] == h[k - 1]; k--) {
+        }
+        if (k <= mem) {
+            return (size_t)(h - (const unsigned char *)hay);
+        }
+        h += m->p;
+        mem = m->mem0;
     }
-    if (!found_any) {
-        nob_log(NOB_WARNING, "Found no matches for patch ?? %.*s... ??", (int)(min(patch.to_match.count, 20)), patch.to_match.data);
+    return MATCH_NONE;
+}
+
+// Finds all non overlapping matches of the rule in the input, from left to right.
+void find_edits(const patc *patch, const char *in, size_t len, edits *es) {
+    size_t i = 0;
+    while (i < len) {
+        size_t pos = matcher_find(&patch->matcher, in, len, i);
+        if (pos == MATCH_NONE) {
+            break;
+        }
+        nob_da_append(es, ((edit){.offset = pos, .rule = patch}));
+        i = pos + patch->to_match.count;
     }
 }
 
-void run_patch(patches *ps) {
-    Nob_String_Builder front = {0};
-    Nob_String_Builder back = {0};
-    Nob_String_View current_file = {0};
+// Appends the input with all edits applied to out. The output is sized up front so the
+// unmatched spans between edits are copied with a single memcpy each.
+void render_edits(const char *in, size_t len, const edits *es, Nob_String_Builder *out) {
+    size_t size = len;
+    nob_da_foreach(edit, e, es) {
+        size = size - e->rule->to_match.count + e->rule->to_replace.count;
+    }
+    nob_da_reserve(out, out->count + size);
 
-    for (size_t i = 0; i < ps->count; ++i) {
-        patc patch = ps->items[i];
-        const char *filename = nob_temp_sprintf(SV_Fmt, SV_Arg(patch.filename));
-        if (nob_sv_eq(patch.filename, current_file)) {
-            nob_da_reserve(&front, back.count);
-            memcpy(front.items, back.items, back.count);
-            front.count = back.count;
-        } else {
-            const char *current_filename = nob_temp_sprintf(SV_Fmt, SV_Arg(current_file));
+    char *dst = out->items + out->count;
+    size_t i = 0;
+    nob_da_foreach(edit, e, es) {
+        memcpy(dst, in + i, e->offset - i);
+        dst += e->offset - i;
+        memcpy(dst, e->rule->to_replace.data, e->rule->to_replace.count);
+        dst += e->rule->to_replace.count;
+        i = e->offset + e->rule->to_match.count;
+    }
+    memcpy(dst, in + i, len - i);
+    out->count += size;
+}
 
-            if (!nowrite) {
-                nob_copy_file(filename, nob_temp_sprintf("%s.bak", filename));
-                if (back.count > 0 && !nob_write_entire_file(current_filename, back.items, back.count)) {
-                    report_error("failed to write patch file %s", filename);
-                }
-            } else {
-                if (back.count > 0) {
-                    printf("File %s after patching:\n%.*s\n", current_filename, (int)back.count, back.items);
+static uint32_t ac_child(const ac_automaton *ac, uint32_t node, unsigned char c) {
+    if (node == 0) {
+        return ac->root[c];
+    }
+    for (uint32_t child = ac->items[node].child; child != 0; child = ac->items[child].sibling) {
+        if (ac->items[child].byte == c) {
+            return child;
+        }
+    }
+    return 0;
+}
+
+static uint32_t ac_step(const ac_automaton *ac, uint32_t node, unsigned char c) {
+    while (true) {
+        uint32_t next = ac_child(ac, node, c);
+        if (next != 0 || node == 0) {
+            return next;
+        }
+        node = ac->items[node].fail;
+    }
+}
+
+void ac_build(ac_automaton *ac, const target *t) {
+    ac->count = 0;
+    ac->t = t;
+    memset(ac->root, 0, sizeof(ac->root));
+    ac->hits = NOB_REALLOC(ac->hits, t->count * sizeof(*ac->hits));
+    NOB_ASSERT(ac->hits != NULL && "Buy more RAM lol");
+    memset(ac->hits, 0, t->count * sizeof(*ac->hits));
+    nob_da_append(ac, ((ac_node){.rule = UINT32_MAX}));
+
+    for (size_t r = 0; r < t->count; ++r) {
+        Nob_String_View m = t->items[r]->to_match;
+        if (m.count == 0) {
+            continue;
+        }
+        uint32_t node = 0;
+        for (size_t i = 0; i < m.count; ++i) {
+            unsigned char c = (unsigned char)m.data[i];
+            uint32_t next = ac_child(ac, node, c);
+            if (next == 0) {
+                next = (uint32_t)ac->count;
+                ac_node n = {.depth = (uint32_t)(i + 1), .rule = UINT32_MAX, .byte = c};
+                if (node == 0) {
+                    ac->root[c] = next;
+                } else {
+                    n.sibling = ac->items[node].child;
+                    ac->items[node].child = next;
                 }
+                nob_da_append(ac, n);
             }
+            node = next;
+        }
+        // Identical patterns resolve to the rule declared first
+        if (ac->items[node].rule == UINT32_MAX) {
+            ac->items[node].rule = (uint32_t)r;
+        }
+    }
 
-            current_file = patch.filename;
-            front.count = 0;
-            if (!nob_read_entire_file(filename, &front)) {
-                report_error("failed to read file to patch %s", filename);
-            }
+    ac_queue queue = {0};
+    for (size_t c = 0; c < 256; ++c) {
+        if (ac->root[c] != 0) {
+            nob_da_append(&queue, ac->root[c]);
+        }
+    }
+    for (size_t head = 0; head < queue.count; ++head) {
+        uint32_t node = queue.items[head];
+        ac_node *n = &ac->items[node];
+        n->out = n->rule != UINT32_MAX ? node : ac->items[n->fail].out;
+        for (uint32_t child = n->child; child != 0; child = ac->items[child].sibling) {
+            ac->items[child].fail = ac_step(ac, n->fail, ac->items[child].byte);
+            nob_da_append(&queue, child);
         }
-        back.count = 0;
-        nob_log(NOB_INFO, "Patching file %s", filename);
-        apply_patc(patch, &front, &back);
     }
+    nob_da_free(queue);
+}
 
-    const char *filename = nob_temp_sprintf(SV_Fmt, SV_Arg(current_file));
-    if (back.count > 0) {
-        if (!nowrite && !nob_write_entire_file(filename, back.items, back.count)) {
-            return;
-        } else if (nowrite) {
-            printf("File %s after patching:\n%.*s\n", filename, (int)back.count, back.items);
+// Finds the matches of all rules of the target in a single scan. Overlaps resolve to the
+// leftmost match, then to the longest match starting there, then to the rule declared first.
+void ac_find_edits(ac_automaton *ac, const char *in, size_t len, edits *es) {
+    const ac_node *nodes = ac->items;
+    uint32_t state = 0;
+    bool have_best = false;
+    size_t best_start = 0;
+    uint32_t best_rule = 0;
+    size_t best_len = 0;
+
+    size_t i = 0;
+    while (i < len || have_best) {
+        if (i < len) {
+            state = ac_step(ac, state, (unsigned char)in[i]);
+            i++;
+            for (uint32_t node = nodes[state].out; node != 0; node = nodes[nodes[node].fail].out) {
+                size_t start = i - nodes[node].depth;
+                if (!have_best || start < best_start || (start == best_start && nodes[node].depth > best_len)) {
+                    have_best = true;
+                    best_start = start;
+                    best_len = nodes[node].depth;
+                    best_rule = nodes[node].rule;
+                }
+            }
+        }
+        // Every match found from here on starts at i - depth or later
+        if (have_best && (i == len || i - nodes[state].depth > best_start)) {
+            nob_da_append(es, ((edit){.offset = best_start, .rule = ac->t->items[best_rule]}));
+            ac->hits[best_rule]++;
+            have_best = false;
+            i = best_start + best_len;
+            state = 0;
         }
     }
 }
 
-void run_restore(patches *ps) {
-    files fs = {0};
+uint64_t sv_hash(Nob_String_View sv) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sv.count; ++i) {
+        hash ^= (unsigned char)sv.data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void target_index_insert(targets *ts, size_t target_idx) {
+    target_index *idx = &ts->index;
+    size_t mask = idx->capacity - 1;
+    size_t slot = sv_hash(ts->items[target_idx].filename) & mask;
+    while (idx->slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    idx->slots[slot] = target_idx + 1;
+}
+
+static void target_index_grow(targets *ts) {
+    target_index *idx = &ts->index;
+    free(idx->slots);
+    idx->capacity = idx->capacity == 0 ? 64 : idx->capacity * 2;
+    idx->slots = calloc(idx->capacity, sizeof(*idx->slots));
+    NOB_ASSERT(idx->slots != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < ts->count; ++i) {
+        target_index_insert(ts, i);
+    }
+}
+
+// Returns the slot of the file, which is empty if there is no target for the file
+static size_t target_index_slot(const targets *ts, Nob_String_View filename) {
+    const target_index *idx = &ts->index;
+    size_t mask = idx->capacity - 1;
+    size_t slot = sv_hash(filename) & mask;
+    while (idx->slots[slot] != 0 && !nob_sv_eq(ts->items[idx->slots[slot] - 1].filename, filename)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Returns the target for the file or NULL if there is none
+target *targets_find(const targets *ts, Nob_String_View filename) {
+    if (ts->index.capacity == 0) {
+        return NULL;
+    }
+    size_t slot = target_index_slot(ts, filename);
+    return ts->index.slots[slot] == 0 ? NULL : &ts->items[ts->index.slots[slot] - 1];
+}
+
+// Returns the target for the file, adding an empty one if the file was not seen before
+target *targets_get(targets *ts, Nob_String_View filename) {
+    if (2 * (ts->count + 1) > ts->index.capacity) {
+        target_index_grow(ts);
+    }
+    size_t slot = target_index_slot(ts, filename);
+    if (ts->index.slots[slot] == 0) {
+        nob_da_append(ts, ((target){.filename = filename}));
+        ts->index.slots[slot] = ts->count;
+    }
+    return &ts->items[ts->index.slots[slot] - 1];
+}
+
+void targets_free(targets *ts) {
+    nob_da_foreach(target, t, ts) {
+        nob_da_free(*t);
+    }
+    nob_da_free(*ts);
+    free(ts->index.slots);
+    memset(ts, 0, sizeof(*ts));
+}
+
+// Collects the rules into one target per file, in the order the files first appear. The
+// rules of a target keep their declaration order, so every file is read, patched and
+// written once even if its rules are spread over the patch file.
+void collect_targets(patches *ps, targets *ts) {
     for (size_t i = 0; i < ps->count; ++i) {
-        patc p = ps->items[i];
-        bool is_in = false;
-        for (size_t j = 0; j < fs.count; ++j) {
-            if (nob_sv_eq(fs.items[j], p.filename)) {
-                is_in = true;
-                break;
+        target *t = targets_get(ts, ps->items[i].filename);
+        nob_da_append(t, &ps->items[i]);
+    }
+}
+
+NOB_PRINTF_FORMAT(3, 4) void target_log(target *t, Nob_Log_Level level, const char *fmt, ...) {
+    if (level < nob_minimal_log_level) {
+        return;
+    }
+    switch (level) {
+    case NOB_INFO:
+        nob_sb_append_cstr(&t->log, "[INFO] ");
+        break;
+    case NOB_WARNING:
+        nob_sb_append_cstr(&t->log, "[WARNING] ");
+        break;
+    case NOB_ERROR:
+        nob_sb_append_cstr(&t->log, "[ERROR] ");
+        break;
+    default:
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    nob_da_reserve(&t->log, t->log.count + n + 1);
+    va_start(args, fmt);
+    vsnprintf(t->log.items + t->log.count, n + 1, fmt, args);
+    va_end(args);
+    t->log.count += n;
+    nob_da_append(&t->log, '\n');
+}
+
+void warn_no_match(target *t, const patc *patch) {
+    target_log(t, NOB_WARNING, "Found no matches for patch ?? %.*s... ??", (int)(min(patch->to_match.count, 20)), patch->to_match.data);
+}
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    size_t target;
+} file_id;
+
+static int file_id_compare(const void *a, const void *b) {
+    const file_id *x = a;
+    const file_id *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return x->target < y->target ? -1 : x->target > y->target;
+}
+
+// The rules are pointers into the parsed patch file, so their order is declaration order
+static int rule_compare(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(const patc *const *)a;
+    uintptr_t y = (uintptr_t)*(const patc *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Merges targets which name the same file, like a.txt and ./a.txt or a link and the file it
+// points to, into the first of them with the rules in declaration order. As separate
+// targets the file would be read, backed up and written twice, by two jobs at once.
+// A link is patched as the file it points to, so the patched file is renamed over that file
+// instead of replacing the link, and backups and staged files are kept next to it.
+void merge_aliases(targets *ts) {
+    file_id *ids = NOB_REALLOC(NULL, (ts->count + 1) * sizeof(*ids));
+    NOB_ASSERT(ids != NULL && "Buy more RAM lol");
+    size_t count = 0;
+    nob_da_foreach(target, t, ts) {
+        struct stat st;
+        if (lstat(t->path, &st) == 0 && S_ISLNK(st.st_mode)) {
+            char *resolved = realpath(t->path, NULL);
+            if (resolved != NULL) {
+                target_log(t, NOB_INFO, "%s links to %s, patching that file", t->path, resolved);
+                t->path = nob_temp_strdup(resolved);
+                free(resolved);
             }
         }
-        if (!is_in) {
-            nob_da_append(&fs, p.filename);
+        // A file which cannot be found fails when it is patched
+        if (stat(t->path, &st) == 0) {
+            ids[count++] = (file_id){.dev = st.st_dev, .ino = st.st_ino, .target = (size_t)(t - ts->items)};
+        }
+    }
+    qsort(ids, count, sizeof(*ids), file_id_compare);
+
+    bool merged = false;
+    for (size_t first = 0, i = 1; i < count; ++i) {
+        if (ids[i].dev != ids[first].dev || ids[i].ino != ids[first].ino) {
+            first = i;
+            continue;
+        }
+        target *into = &ts->items[ids[first].target];
+        target *alias = &ts->items[ids[i].target];
+        target_log(into, NOB_INFO, "%s is the same file as %s, patching it once", alias->path, into->path);
+        nob_da_append_many(into, alias->items, alias->count);
+        qsort(into->items, into->count, sizeof(*into->items), rule_compare);
+        nob_da_free(*alias);
+        alias->path = NULL;
+        merged = true;
+    }
+    NOB_FREE(ids);
+    if (!merged) {
+        return;
+    }
+
+    size_t kept = 0;
+    nob_da_foreach(target, t, ts) {
+        if (t->path != NULL) {
+            ts->items[kept++] = *t;
         }
     }
-    for (size_t i = 0; i < fs.count; ++i) {
-        nob_copy_file(nob_temp_sprintf(SV_Fmt ".bak", SV_Arg(fs.items[i])),
-                      nob_temp_sprintf(SV_Fmt, SV_Arg(fs.items[i])));
+    ts->count = kept;
+    free(ts->index.slots);
+    ts->index.slots = NULL;
+    ts->index.capacity = 0;
+    while (2 * ts->count > ts->index.capacity) {
+        target_index_grow(ts);
     }
 }
 
-int main(int argc, char *argv[]) {
-    const char *cmd = ccli_parse_opts(commands, options, argc, argv, NULL);
+typedef struct {
+    struct iovec *items;
+    size_t count;
+    size_t capacity;
+} segments;
 
-    Nob_String_Builder frdr = {0};
-    if (!nob_read_entire_file(patch_file, &frdr)) {
-        return 1;
+// A byte range of a file patched in place which differs from the original
+typedef struct {
+    size_t offset;
+    const char *data; // the new bytes
+    size_t size;
+} range;
+
+typedef struct {
+    range *items;
+    size_t count;
+    size_t capacity;
+} ranges;
+
+#ifdef PATC_IO_URING
+// io_uring of a job. Files are opened into a registered slot, so opening, reading or
+// writing and closing a file are linked and submitted together with a single system call.
+typedef struct {
+    int fd; // -1 if the ring is not set up
+    void *map;
+    size_t map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned tail; // submission queue tail including entries not yet handed to the kernel
+} io_ring;
+#else
+typedef struct {
+    int fd;
+} io_ring;
+#endif // PATC_IO_URING
+
+// Scratch state of a thread patching targets, reused from one target to the next
+typedef struct {
+    Nob_String_Builder front;
+    Nob_String_Builder back;
+    Nob_String_View base; // the patched content is es applied to base
+    edits es;
+    ac_automaton ac;
+    segments segs;
+    Nob_String_Builder path;
+    Nob_String_Builder temp; // name of the file being written by atomic_open
+    Nob_String_Builder dir;
+    Nob_String_Builder blob;
+    ranges changes;
+    Nob_String_Builder chunk; // written to the file by write_tail and write_shifted
+    Nob_String_Builder saved; // original bytes write_tail overwrote but still has to copy
+    Nob_String_Builder input; // small files read through the ring
+    io_ring ring;
+    const targets *queue; // the next unclaimed target is prefetched
+    const size_t *cursor;
+} worker;
+
+// Returns the path of the target with the suffix appended, valid until the next call
+const char *worker_path(worker *w, const target *t, const char *suffix) {
+    w->path.count = 0;
+    nob_sb_append_cstr(&w->path, t->path);
+    nob_sb_append_cstr(&w->path, suffix);
+    nob_sb_append_null(&w->path);
+    return w->path.items;
+}
+
+// Returns the directory containing path, valid until sb changes
+const char *path_dir(Nob_String_Builder *sb, const char *path) {
+    const char *slash = strrchr(path, '/');
+    sb->count = 0;
+    if (slash == NULL) {
+        nob_sb_append_cstr(sb, ".");
+    } else if (slash == path) {
+        nob_sb_append_cstr(sb, "/");
+    } else {
+        nob_sb_append_buf(sb, path, (size_t)(slash - path));
     }
+    nob_sb_append_null(sb);
+    return sb->items;
+}
 
-    parser p = {
-        .filename = patch_file,
-        .input = frdr.items,
-        .cursor = frdr.items,
-        .len = frdr.count};
-    patches ps = {0};
-    parse_file(&p, &ps);
+// Flushes the directory containing path so a file created or renamed there survives a crash
+void sync_dir(Nob_String_Builder *sb, const char *path) {
+    int dir_fd = open(path_dir(sb, path), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// The file helpers below do not log. They leave errno set on failure so the caller can
+// report the error in the log of the target.
+
+bool read_fd(int fd, Nob_String_Builder *sb) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return false;
+    }
+    if ((uint64_t)st.st_size > SIZE_MAX - sb->count) {
+        errno = EFBIG;
+        return false;
+    }
+    nob_da_reserve(sb, sb->count + (size_t)st.st_size);
+    for (;;) {
+        if (sb->count == sb->capacity) {
+            size_t grow = sb->capacity + 1;
+            nob_da_reserve(sb, grow);
+        }
+        ssize_t n = read(fd, sb->items + sb->count, sb->capacity - sb->count);
+        if (n == 0) {
+            return true;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sb->count += (size_t)n;
+    }
+}
+
+bool read_file(const char *path, Nob_String_Builder *sb) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = read_fd(fd, sb);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok;
+}
+
+// Bytes at the start of the next target read ahead while the current one is patched
+#define PREFETCH_SIZE ((size_t)4 << 20)
+
+#ifdef PATC_IO_URING
+#define RING_ENTRIES 8
+#define RING_SLOT 0
+// Regular files up to this size are read through the ring, larger files are mapped
+#define RING_FILE_MAX ((size_t)128 << 10)
+
+void ring_free(io_ring *r) {
+    if (r->fd < 0) {
+        return;
+    }
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->map != NULL) {
+        munmap(r->map, r->map_size);
+    }
+    close(r->fd);
+    r->fd = -1;
+}
+
+// Sets up the ring if the kernel supports every operation it needs, r->fd stays -1 otherwise
+bool ring_setup(io_ring *r) {
+    memset(r, 0, sizeof(*r));
+    struct io_uring_params p = {0};
+    r->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        return false;
+    }
+
+    bool result = true;
+    struct io_uring_probe *probe = NULL;
+    // Kernels which map the queues separately also lack the operations used here
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        nob_return_defer(false);
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->map_size = sq_size > cq_size ? sq_size : cq_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        nob_return_defer(false);
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        nob_return_defer(false);
+    }
+    char *q = r->map;
+    r->sq_head = (unsigned *)(q + p.sq_off.head);
+    r->sq_tail = (unsigned *)(q + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(q + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(q + p.sq_off.array);
+    r->cq_head = (unsigned *)(q + p.cq_off.head);
+    r->cq_tail = (unsigned *)(q + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(q + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(q + p.cq_off.cqes);
+    r->tail = *r->sq_tail;
+
+    // An operation the kernel does not know would only fail once submitted
+    static const unsigned char ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITEV, IORING_OP_FSYNC, IORING_OP_SYNC_FILE_RANGE, IORING_OP_FADVISE, IORING_OP_CLOSE};
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    NOB_ASSERT(probe != NULL && "Buy more RAM lol");
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        nob_return_defer(false);
+    }
+    for (size_t i = 0; i < NOB_ARRAY_LEN(ops); ++i) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = ENOSYS;
+            nob_return_defer(false);
+        }
+    }
+    int slots[RING_SLOT + 1];
+    memset(slots, -1, sizeof(slots));
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, slots, NOB_ARRAY_LEN(slots)) < 0) {
+        nob_return_defer(false);
+    }
+
+defer:
+    free(probe);
+    if (!result) {
+        int err = errno;
+        ring_free(r);
+        errno = err;
+    }
+    return result;
+}
+
+static struct io_uring_sqe *ring_sqe(io_ring *r, unsigned char opcode, uint64_t id) {
+    unsigned i = r->tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = id;
+    r->sq_array[i] = i;
+    r->tail++;
+    return sqe;
+}
+
+static void ring_close_slot(io_ring *r, uint64_t id) {
+    struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_CLOSE, id);
+    sqe->file_index = RING_SLOT + 1;
+}
+
+// Submits the queued entries and waits for all count of them, res[id] is the result of the
+// entry with that id. The ring is torn down if the kernel refuses it.
+static bool ring_run(io_ring *r, int *res, unsigned count) {
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    unsigned done = 0;
+    while (done < count) {
+        unsigned submit = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, r->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            ring_free(r);
+            return false;
+        }
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            res[cqe->user_data] = cqe->res;
+            done++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// Kernels before 5.15 ignore the slot and open a plain descriptor, the ring is of no use then
+static bool ring_opened(io_ring *r, int res) {
+    if (res > 0) {
+        close(res);
+        ring_free(r);
+    }
+    return res == 0;
+}
+
+static void stat_from_statx(struct stat *st, const struct statx *stx) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = (off_t)stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = (blkcnt_t)stx->stx_blocks;
+}
+
+// Starts reading the first PREFETCH_SIZE bytes of a regular file into the page cache, with
+// one submission for statx and one to open, advise and close it. Returns false if the file
+// has to be prefetched the usual way.
+bool ring_prefetch(io_ring *r, const char *path) {
+    if (r->fd < 0) {
+        return false;
+    }
+    struct statx stx;
+    struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_STATX, 0);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+    sqe->len = STATX_TYPE;
+    sqe->off = (uintptr_t)&stx;
+    int res[3];
+    if (!ring_run(r, res, 1)) {
+        return false;
+    }
+    if (res[0] < 0 || !S_ISREG(stx.stx_mode)) {
+        return true;
+    }
+
+    sqe = ring_sqe(r, IORING_OP_OPENAT, 0);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+    sqe->open_flags = O_RDONLY | O_NONBLOCK;
+    sqe->file_index = RING_SLOT + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = ring_sqe(r, IORING_OP_FADVISE, 1);
+    sqe->fd = RING_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->len = PREFETCH_SIZE;
+    sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+    ring_close_slot(r, 2);
+    return ring_run(r, res, 3) && (res[0] < 0 || ring_opened(r, res[0]));
+}
+
+// Reads a regular file of up to RING_FILE_MAX bytes into buf with two submissions, one for
+// statx and one to open, read and close it. done is false if the file has to be read the
+// usual way instead.
+bool ring_read_file(io_ring *r, const char *path, Nob_String_Builder *buf, struct stat *st, bool *done) {
+    *done = false;
+    if (r->fd < 0) {
+        return true;
+    }
+    struct statx stx;
+    struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_STATX, 0);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uintptr_t)&stx;
+    int res[3];
+    if (!ring_run(r, res, 1)) {
+        return true;
+    }
+    if (res[0] < 0) {
+        errno = -res[0];
+        return false;
+    }
+    if (!S_ISREG(stx.stx_mode) || stx.stx_size > RING_FILE_MAX) {
+        return true;
+    }
+
+    // Reading a byte more than statx reported shows that the file did not grow since
+    size_t size = (size_t)stx.stx_size;
+    buf->count = 0;
+    nob_da_reserve(buf, size + 1);
+    sqe = ring_sqe(r, IORING_OP_OPENAT, 0);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = RING_SLOT + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = ring_sqe(r, IORING_OP_READ, 1);
+    sqe->fd = RING_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->addr = (uintptr_t)buf->items;
+    sqe->len = (unsigned)(size + 1);
+    ring_close_slot(r, 2);
+    if (!ring_run(r, res, 3)) {
+        return true;
+    }
+    if (res[0] < 0) {
+        errno = -res[0];
+        return false;
+    }
+    if (!ring_opened(r, res[0])) {
+        return true;
+    }
+    if (res[1] < 0) {
+        errno = -res[1];
+        return false;
+    }
+    if ((size_t)res[1] != size) {
+        return true;
+    }
+    buf->count = size;
+    stat_from_statx(st, &stx);
+    *done = true;
+    return true;
+}
+
+// Truncates the file at path and writes the segments to it with a single submission which
+// opens, writes, flushes with per file durability, drops it from the page cache with
+// --drop-cache and closes it. done is false if the file has to be written the usual way.
+bool ring_write_file(io_ring *r, const char *path, segments *segs, bool *done) {
+    *done = false;
+    size_t size = 0;
+    nob_da_foreach(struct iovec, seg, segs) {
+        size += seg->iov_len;
+    }
+    if (r->fd < 0 || segs->count > IOV_MAX || size > RING_FILE_MAX) {
+        return true;
+    }
+    struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_OPENAT, 0);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = 0666;
+    sqe->file_index = RING_SLOT + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = ring_sqe(r, IORING_OP_WRITEV, 1);
+    sqe->fd = RING_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->addr = (uintptr_t)segs->items;
+    sqe->len = (unsigned)segs->count;
+    unsigned count = 2;
+    if (selected_durability == DURABILITY_FILE) {
+        sqe = ring_sqe(r, IORING_OP_FSYNC, count++);
+        sqe->fd = RING_SLOT;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+    if (drop_cache) {
+        sqe = ring_sqe(r, IORING_OP_SYNC_FILE_RANGE, count++);
+        sqe->fd = RING_SLOT;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+        sqe = ring_sqe(r, IORING_OP_FADVISE, count++);
+        sqe->fd = RING_SLOT;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->fadvise_advice = POSIX_FADV_DONTNEED;
+    }
+    ring_close_slot(r, count++);
+    int res[6];
+    if (!ring_run(r, res, count)) {
+        return true;
+    }
+    if (res[0] < 0) {
+        errno = -res[0];
+        return false;
+    }
+    if (!ring_opened(r, res[0])) {
+        return true;
+    }
+    if (res[1] >= 0 && (size_t)res[1] != size) {
+        // A short write is rare enough to simply write the file again the usual way
+        return true;
+    }
+    for (unsigned i = 1; i < count; ++i) {
+        if (res[i] < 0) {
+            errno = -res[i];
+            return false;
+        }
+    }
+    *done = true;
+    return true;
+}
+#else
+bool ring_setup(io_ring *r) {
+    r->fd = -1;
+    errno = ENOSYS;
+    return false;
+}
+
+void ring_free(io_ring *r) {
+    (void)r;
+}
+#endif // PATC_IO_URING
+
+// Starts reading the start of a file into the page cache, so it is there once the file is
+// opened. Only regular files are prefetched, opening a FIFO would let a blocked writer go
+// ahead and lose what it writes once the prefetch closes it again.
+void prefetch_file(worker *w, const char *path) {
+#ifdef PATC_IO_URING
+    if (ring_prefetch(&w->ring, path)) {
+        return;
+    }
+#endif // PATC_IO_URING
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, (off_t)PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+void select_io(void) {
+    if (strcmp(io_arg, "posix") == 0) {
+        selected_io = IO_POSIX;
+        return;
+    }
+    if (strcmp(io_arg, "auto") != 0 && strcmp(io_arg, "uring") != 0) {
+        report_error("unknown io backend %s, expected auto, uring or posix", io_arg);
+    }
+    io_ring probe;
+    bool available = ring_setup(&probe);
+    if (!available && strcmp(io_arg, "uring") == 0) {
+        report_error("io_uring is not available: %s", strerror(errno));
+    }
+    ring_free(&probe);
+    selected_io = available ? IO_URING : IO_POSIX;
+}
+
+// Content of a target file. Regular files are mapped so matching runs directly on the page
+// cache and a file without matches is never copied. Small regular files are read through
+// the ring of the worker instead when it has one, which takes fewer system calls than
+// mapping them. Everything else, like pipes, is read into a buffer. A regular file which is
+// streamed, or cannot be mapped, is left open as fd to be read a chunk at a time.
+typedef struct {
+    Nob_String_View content;
+    void *map;
+    size_t map_size;
+    int fd;
+    struct stat st;
+    bool pinned; // content is the original and stays unchanged until the source is closed
+} source;
+
+// If can_stream, regular files of stream_from bytes or more are streamed, and so are those
+// which cannot be mapped
+bool source_open(source *src, worker *w, const char *path, bool can_stream, uint64_t stream_from) {
+    memset(src, 0, sizeof(*src));
+    src->fd = -1;
+#ifdef PATC_IO_URING
+    if (!can_stream || stream_from > RING_FILE_MAX) {
+        bool done;
+        if (!ring_read_file(&w->ring, path, &w->input, &src->st, &done)) {
+            return false;
+        }
+        if (done) {
+            src->content = nob_sb_to_sv(w->input);
+            src->pinned = true;
+            return true;
+        }
+    }
+#endif // PATC_IO_URING
+    Nob_String_Builder *buf = &w->front;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    src->st = st;
+
+    bool regular = S_ISREG(st.st_mode);
+    bool mappable = regular && (uint64_t)st.st_size <= SIZE_MAX;
+    if (regular && can_stream && ((uint64_t)st.st_size >= stream_from || !mappable)) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        src->fd = fd;
+        return true;
+    }
+    if (mappable && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            src->map = map;
+            src->map_size = (size_t)st.st_size;
+            src->pinned = true;
+            src->content = nob_sv_from_parts(map, src->map_size);
+            return true;
+        }
+        if (can_stream) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            src->fd = fd;
+            return true;
+        }
+    }
+
+    if (regular) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    buf->count = 0;
+    bool ok = read_fd(fd, buf);
+    int err = errno;
+    close(fd);
+    errno = err;
+    src->content = nob_sb_to_sv(*buf);
+    return ok;
+}
+
+void source_close(source *src) {
+    if (src->map != NULL) {
+        munmap(src->map, src->map_size);
+    }
+    if (src->fd >= 0) {
+        close(src->fd);
+    }
+    memset(src, 0, sizeof(*src));
+    src->fd = -1;
+}
+
+bool write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, min(size, (size_t)SSIZE_MAX));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+// Collects the patched content as segments which point into base and into the replacements
+// of the rules, so the content is never assembled in memory
+void collect_segments(Nob_String_View base, const edits *es, segments *segs) {
+    segs->count = 0;
+    size_t i = 0;
+    nob_da_foreach(edit, e, es) {
+        if (e->offset > i) {
+            nob_da_append(segs, ((struct iovec){.iov_base = (void *)(base.data + i), .iov_len = e->offset - i}));
+        }
+        if (e->rule->to_replace.count > 0) {
+            nob_da_append(segs, ((struct iovec){.iov_base = (void *)e->rule->to_replace.data, .iov_len = e->rule->to_replace.count}));
+        }
+        i = e->offset + e->rule->to_match.count;
+    }
+    if (base.count > i) {
+        nob_da_append(segs, ((struct iovec){.iov_base = (void *)(base.data + i), .iov_len = base.count - i}));
+    }
+}
+
+// Writes all segments in batches of at most IOV_MAX, resuming partial writes
+bool writev_all(int fd, struct iovec *iov, size_t count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, (int)min(count, (size_t)IOV_MAX));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        size_t written = (size_t)n;
+        while (count > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+static size_t temp_counter;
+
+// Gives a file which replaces another the mode and, where permitted, the owner of the other
+bool copy_owner_and_mode(int fd, const struct stat *st) {
+    if (fchown(fd, st->st_uid, st->st_gid) < 0) {
+        // Only root may give the file away, keeping our own ownership is fine
+    }
+    return fchmod(fd, st->st_mode & 07777) == 0;
+}
+
+// Creates the file which atomic_commit renames over path. The file is created with O_TMPFILE
+// and only gets a name once it is complete, or with mkstemp where O_TMPFILE is not
+// supported, in which case named is set.
+int atomic_open(worker *w, const char *path, const struct stat *st, bool *named) {
+    int fd = -1;
+    *named = false;
+#ifdef O_TMPFILE
+    fd = open(path_dir(&w->dir, path), O_TMPFILE | O_WRONLY, st->st_mode & 07777);
+#else
+    (void)st;
+#endif // O_TMPFILE
+    if (fd < 0) {
+        w->temp.count = 0;
+        nob_sb_appendf(&w->temp, "%s.patc-XXXXXX", path);
+        fd = mkstemp(w->temp.items);
+        *named = fd >= 0;
+    }
+    return fd;
+}
+
+// Closes the file of atomic_open and removes it if it has a name
+void atomic_abort(worker *w, int fd, bool named) {
+    int err = errno;
+    close(fd);
+    if (named) {
+        unlink(w->temp.items);
+    }
+    errno = err;
+}
+
+// Renames the file of atomic_open over the target, so a crash leaves either the old or the
+// new content behind. The new file takes over the mode and, where permitted, the owner of
+// the old file. With batched durability the file is only named and left pending, it is
+// renamed once all files are flushed.
+bool atomic_commit(target *t, worker *w, int fd, bool named, const struct stat *st) {
+    const char *path = t->path;
+    bool ok = copy_owner_and_mode(fd, st) && sync_file(fd);
+
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    while (ok && !named) {
+        w->temp.count = 0;
+        nob_sb_appendf(&w->temp, "%s.patc-%ld-%zu", path, (long)getpid(), __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED));
+        if (linkat(AT_FDCWD, proc_path, AT_FDCWD, w->temp.items, AT_SYMLINK_FOLLOW) == 0) {
+            named = true;
+        } else if (errno != EEXIST) {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        atomic_abort(w, fd, named);
+        return false;
+    }
+
+    int err = 0;
+    if (close(fd) < 0) {
+        err = errno;
+        ok = false;
+    }
+    if (ok && selected_durability == DURABILITY_BATCH) {
+        t->pending = strdup(w->temp.items);
+        NOB_ASSERT(t->pending != NULL && "Buy more RAM lol");
+        return true;
+    }
+    if (ok && rename(w->temp.items, path) < 0) {
+        err = errno;
+        ok = false;
+    }
+    if (!ok) {
+        unlink(w->temp.items);
+    }
+    if (ok && selected_durability == DURABILITY_FILE) {
+        sync_dir(&w->dir, path);
+    }
+    errno = err;
+    return ok;
+}
+
+// Writes the segments to a new file next to the target and renames it over the target
+bool write_atomic(target *t, worker *w, const struct stat *st) {
+    bool named;
+    int fd = atomic_open(w, t->path, st, &named);
+    if (fd < 0) {
+        return false;
+    }
+    if (!writev_all(fd, w->segs.items, w->segs.count)) {
+        atomic_abort(w, fd, named);
+        return false;
+    }
+    return atomic_commit(t, w, fd, named, st);
+}
+
+#ifdef __linux__
+// Errors of copy_file_range and sendfile which mean the files are not supported and the next
+// copy method should take over from the current file offsets
+static bool copy_unsupported(int err) {
+    return err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EINVAL;
+}
+#endif // __linux__
+
+// Copies the content of src to dst through the cheapest method the file systems support.
+// A reflink shares the extents of src and copies nothing. copy_file_range and sendfile copy
+// within the kernel. The read/write loop is the last resort. Every method continues from
+// the file offsets the previous one stopped at.
+bool copy_fd(int src, int dst) {
+#ifdef __linux__
+#ifdef FICLONE
+    if (ioctl(dst, FICLONE, src) == 0) {
+        return true;
+    }
+#endif // FICLONE
+    const size_t chunk = 1 << 30;
+    for (;;) {
+        ssize_t n = copy_file_range(src, NULL, dst, NULL, chunk, 0);
+        if (n == 0) {
+            return true;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!copy_unsupported(errno)) {
+                return false;
+            }
+            break;
+        }
+    }
+    for (;;) {
+        ssize_t n = sendfile(dst, src, NULL, chunk);
+        if (n == 0) {
+            return true;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!copy_unsupported(errno)) {
+                return false;
+            }
+            break;
+        }
+    }
+#endif // __linux__
+
+    char buf[32 * 1024];
+    for (;;) {
+        ssize_t n = read(src, buf, sizeof(buf));
+        if (n == 0) {
+            return true;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (!write_all(dst, buf, (size_t)n)) {
+            return false;
+        }
+    }
+}
+
+bool copy_file(const char *src_path, const char *dst_path, bool durable) {
+    int src = open(src_path, O_RDONLY);
+    if (src < 0) {
+        return false;
+    }
+    struct stat st;
+    int dst = -1;
+    bool ok = fstat(src, &st) == 0 && (dst = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode)) >= 0;
+    ok = ok && copy_fd(src, dst);
+    ok = ok && (!durable || fdatasync(dst) == 0);
+
+    int err = errno;
+    close(src);
+    if (dst >= 0 && close(dst) < 0 && ok) {
+        return false;
+    }
+    errno = err;
+    return ok;
+}
+
+#define ror32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_block(uint32_t h[8], const unsigned char *p) {
+    uint32_t w[64];
+    for (size_t i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (size_t i = 16; i < 64; ++i) {
+        uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (size_t i = 0; i < 64; ++i) {
+        uint32_t t1 = k + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+// SHA-256 of data passed in pieces. Streamed files are hashed a chunk at a time.
+typedef struct {
+    uint32_t h[8];
+    uint64_t size;
+    unsigned char block[64];
+} sha256;
+
+void sha256_init(sha256 *s) {
+    static const uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->h, h, sizeof(h));
+    s->size = 0;
+}
+
+void sha256_update(sha256 *s, const char *data, size_t size) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t used = (size_t)(s->size % 64);
+    s->size += size;
+    if (used > 0) {
+        size_t n = min(size, 64 - used);
+        memcpy(s->block + used, p, n);
+        p += n;
+        size -= n;
+        if (used + n < 64) {
+            return;
+        }
+        sha256_block(s->h, s->block);
+    }
+    for (; size >= 64; p += 64, size -= 64) {
+        sha256_block(s->h, p);
+    }
+    if (size > 0) {
+        memcpy(s->block, p, size);
+    }
+}
+
+// Writes the hash as 64 hex digits and a terminating null to hex
+void sha256_final(sha256 *s, char hex[65]) {
+    // The rest of the data, a one bit, zeros and the size in bits fill one or two blocks
+    unsigned char tail[128] = {0};
+    size_t rest = (size_t)(s->size % 64);
+    memcpy(tail, s->block, rest);
+    tail[rest] = 0x80;
+    size_t tail_size = rest < 56 ? 64 : 128;
+    uint64_t bits = s->size * 8;
+    for (size_t j = 0; j < 8; ++j) {
+        tail[tail_size - 1 - j] = (unsigned char)(bits >> (8 * j));
+    }
+    for (size_t j = 0; j < tail_size; j += 64) {
+        sha256_block(s->h, tail + j);
+    }
+
+    static const char digits[] = "0123456789abcdef";
+    for (size_t j = 0; j < 64; ++j) {
+        hex[j] = digits[(s->h[j / 8] >> (28 - 4 * (j % 8))) & 0xf];
+    }
+    hex[64] = '\0';
+}
+
+void sha256_hex(const char *data, size_t size, char hex[65]) {
+    sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, data, size);
+    sha256_final(&s, hex);
+}
+
+// The backup store keeps every original once, in a file named by the SHA-256 of its
+// content. Its manifest maps the patched files to their originals with one "<hash> <path>"
+// line per file.
+const char *store_blob_path(Nob_String_Builder *sb, const char *hash) {
+    sb->count = 0;
+    nob_sb_appendf(sb, "%s/%s", store, hash);
+    return sb->items;
+}
+
+// Copies the file into the store as the blob unless the store already holds the blob. The
+// copy is renamed into place once complete, so a blob in the store is always whole.
+bool store_blob(worker *w, const char *path, const char *blob, bool *stored) {
+    *stored = false;
+    if (access(blob, F_OK) == 0) {
+        return true;
+    }
+    w->path.count = 0;
+    nob_sb_appendf(&w->path, "%s.tmp-%ld-%zu", blob, (long)getpid(), __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED));
+    bool durable = selected_durability != DURABILITY_NONE;
+    if (!copy_file(path, w->path.items, durable) || rename(w->path.items, blob) < 0) {
+        int err = errno;
+        unlink(w->path.items);
+        errno = err;
+        return false;
+    }
+    if (durable) {
+        sync_dir(&w->dir, blob);
+    }
+    *stored = true;
+    return true;
+}
+
+// Reads the entries of the manifest into targets. A missing manifest has no entries.
+bool read_manifest(const char *path, Nob_String_Builder *sb, targets *entries) {
+    if (!read_file(path, sb)) {
+        return errno == ENOENT;
+    }
+
+    Nob_String_View content = nob_sb_to_sv(*sb);
+    while (content.count > 0) {
+        Nob_String_View line = nob_sv_chop_by_delim(&content, '\n');
+        if (line.count < 66 || line.data[64] != ' ') {
+            nob_log(NOB_WARNING, "ignoring malformed line in manifest %s: " SV_Fmt, path, SV_Arg(line));
+            continue;
+        }
+        target *e = targets_get(entries, nob_sv_from_parts(line.data + 65, line.count - 65));
+        memcpy(e->stored, line.data, 64);
+        e->stored[64] = '\0';
+    }
+    return true;
+}
+
+// Records the originals stored for the targets in the manifest. Entries of files which
+// were not patched now are kept, the others point to the latest original.
+bool update_manifest(const targets *ts) {
+    const char *path = nob_temp_sprintf("%s/manifest", store);
+    Nob_String_Builder content = {0};
+    targets entries = {0};
+    bool result = true;
+    if (!read_manifest(path, &content, &entries)) {
+        nob_log(NOB_ERROR, "could not read manifest %s: %s", path, strerror(errno));
+        nob_return_defer(false);
+    }
+    nob_da_foreach(target, t, ts) {
+        if (t->stored[0] != '\0') {
+            memcpy(targets_get(&entries, t->filename)->stored, t->stored, sizeof(t->stored));
+        }
+    }
+
+    Nob_String_Builder out = {0};
+    nob_da_foreach(target, e, &entries) {
+        nob_sb_appendf(&out, "%s " SV_Fmt "\n", e->stored, SV_Arg(e->filename));
+    }
+    const char *temp_path = nob_temp_sprintf("%s.tmp-%ld", path, (long)getpid());
+    if (!nob_write_entire_file(temp_path, out.items, out.count)) {
+        nob_sb_free(out);
+        nob_return_defer(false);
+    }
+    nob_sb_free(out);
+    if (rename(temp_path, path) < 0) {
+        nob_log(NOB_ERROR, "could not update manifest %s: %s", path, strerror(errno));
+        unlink(temp_path);
+        nob_return_defer(false);
+    }
+
+defer:
+    nob_sb_free(content);
+    targets_free(&entries);
+    return result;
+}
+
+// Applies all rules of the target to the content of the file. The patched content is left
+// as w->es applied to w->base, so the edits of the last rule which matched are never
+// rendered and can be written straight from their input. In sequential mode the rules
+// before render into w->front and w->back, which take turns as input and output so
+// chaining rules never copies between them. A buffered source lives in w->front and is
+// only overwritten once the first output in w->back has replaced it as input.
+void patch_target(target *t, worker *w, Nob_String_View content) {
+    w->base = content;
+    w->es.count = 0;
+    if (sequential || t->count == 1) {
+        Nob_String_Builder *out = &w->back;
+        Nob_String_Builder *spare = &w->front;
+        for (size_t i = 0; i < t->count; ++i) {
+            if (w->es.count > 0) {
+                out->count = 0;
+                render_edits(w->base.data, w->base.count, &w->es, out);
+                w->base = nob_sb_to_sv(*out);
+                w->es.count = 0;
+                Nob_String_Builder *tmp = out;
+                out = spare;
+                spare = tmp;
+            }
+            find_edits(t->items[i], w->base.data, w->base.count, &w->es);
+            if (w->es.count == 0) {
+                warn_no_match(t, t->items[i]);
+            }
+            t->matches += w->es.count;
+        }
+        return;
+    }
+
+    ac_build(&w->ac, t);
+    ac_find_edits(&w->ac, content.data, content.count, &w->es);
+    t->matches = w->es.count;
+    for (size_t i = 0; i < t->count; ++i) {
+        if (w->ac.hits[i] == 0) {
+            warn_no_match(t, t->items[i]);
+        }
+    }
+}
+
+bool edits_keep_size(const edits *es) {
+    nob_da_foreach(edit, e, es) {
+        if (e->rule->to_match.count != e->rule->to_replace.count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Collects the ranges the size preserving edits change. Bytes a replacement leaves as they
+// are at either end of a match are not part of its range.
+void collect_changes(Nob_String_View base, const edits *es, ranges *rs) {
+    rs->count = 0;
+    nob_da_foreach(edit, e, es) {
+        const char *old = base.data + e->offset;
+        const char *new = e->rule->to_replace.data;
+        size_t start = 0;
+        size_t end = e->rule->to_replace.count;
+        while (start < end && old[start] == new[start]) {
+            start++;
+        }
+        while (end > start && old[end - 1] == new[end - 1]) {
+            end--;
+        }
+        if (start < end) {
+            nob_da_append(rs, ((range){.offset = e->offset + start, .data = new + start, .size = end - start}));
+        }
+    }
+}
+
+bool pwrite_all(int fd, const char *data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, min(size, (size_t)SSIZE_MAX), offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return true;
+}
+
+// The undo log of a file patched in place holds the original bytes of the changed ranges.
+// After the magic every range is stored as its offset and size, both 64 bit little endian,
+// followed by the bytes.
+#define UNDO_MAGIC "patc-undo 1\n"
+
+static void undo_append_u64(Nob_String_Builder *sb, uint64_t n) {
+    for (size_t i = 0; i < 8; ++i) {
+        nob_da_append(sb, (char)(n >> (8 * i)));
+    }
+}
+
+static uint64_t undo_read_u64(const char *p) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        n |= (uint64_t)(unsigned char)p[i] << (8 * i);
+    }
+    return n;
+}
+
+// The log holds original bytes of the file, so it gets the permissions of the file
+bool write_undo(const char *path, Nob_String_View base, const ranges *rs, mode_t mode) {
+    Nob_String_Builder log = {0};
+    nob_sb_append_cstr(&log, UNDO_MAGIC);
+    nob_da_foreach(range, r, rs) {
+        undo_append_u64(&log, r->offset);
+        undo_append_u64(&log, r->size);
+        nob_sb_append_buf(&log, base.data + r->offset, r->size);
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode & 0666);
+    bool ok = fd >= 0 && fchmod(fd, mode & 0666) == 0 && write_all(fd, log.items, log.count);
+    // The log has to be on disk before the file changes, otherwise a crash may leave the
+    // file patched without a way back. This holds for batched durability as well.
+    ok = ok && (selected_durability == DURABILITY_NONE || fdatasync(fd) == 0);
+    int err = errno;
+    if (fd >= 0 && close(fd) < 0 && ok) {
+        err = errno;
+        ok = false;
+    }
+    nob_sb_free(log);
+    errno = err;
+    return ok;
+}
+
+// Writes the original bytes of the undo log back into the file
+bool apply_undo(const char *undo_path, const char *path) {
+    Nob_String_Builder log = {0};
+    int fd = -1;
+    bool result = true;
+    if (!read_file(undo_path, &log)) {
+        nob_return_defer(false);
+    }
+    size_t magic = strlen(UNDO_MAGIC);
+    if (log.count < magic || memcmp(log.items, UNDO_MAGIC, magic) != 0) {
+        errno = EINVAL;
+        nob_return_defer(false);
+    }
+    fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        nob_return_defer(false);
+    }
+    for (size_t i = magic; i < log.count;) {
+        if (log.count - i < 16) {
+            errno = EINVAL;
+            nob_return_defer(false);
+        }
+        uint64_t offset = undo_read_u64(log.items + i);
+        uint64_t size = undo_read_u64(log.items + i + 8);
+        i += 16;
+        if (size > log.count - i || offset > (uint64_t)INT64_MAX - size) {
+            errno = EINVAL;
+            nob_return_defer(false);
+        }
+        if (!pwrite_all(fd, log.items + i, (size_t)size, (off_t)offset)) {
+            nob_return_defer(false);
+        }
+        i += (size_t)size;
+    }
+
+defer:;
+    int err = errno;
+    if (fd >= 0 && close(fd) < 0 && result) {
+        err = errno;
+        result = false;
+    }
+    nob_sb_free(log);
+    errno = err;
+    return result;
+}
+
+// Writes only the changed ranges into the file, which keeps its size. The original bytes of
+// the ranges go to the undo log first, unless no backup is made.
+bool patch_in_place(target *t, worker *w, Nob_String_View base, const struct stat *st) {
+    collect_changes(base, &w->es, &w->changes);
+    if (selected_backup != BACKUP_NONE) {
+        const char *undo_path = worker_path(w, t, ".undo");
+        target_log(t, NOB_INFO, "writing undo log %s", undo_path);
+        if (!write_undo(undo_path, base, &w->changes, st->st_mode)) {
+            target_log(t, NOB_ERROR, "failed to write undo log %s: %s", undo_path, strerror(errno));
+            return false;
+        }
+    }
+
+    size_t written = 0;
+    int fd = open(t->path, O_WRONLY);
+    bool ok = fd >= 0;
+    nob_da_foreach(range, r, &w->changes) {
+        ok = ok && pwrite_all(fd, r->data, r->size, (off_t)r->offset);
+        written += r->size;
+    }
+    ok = ok && sync_file(fd);
+    int err = errno;
+    if (fd >= 0 && close(fd) < 0 && ok) {
+        err = errno;
+        ok = false;
+    }
+    if (!ok) {
+        target_log(t, NOB_ERROR, "failed to patch %s in place: %s", t->path, strerror(err));
+        return false;
+    }
+    target_log(t, NOB_INFO, "patched %zu bytes of %s in place", written, t->path);
+    t->written = written;
+    return true;
+}
+
+// The undo log only fits the content it was written for, a rewritten file drops it
+void drop_undo(target *t, worker *w) {
+    unlink(worker_path(w, t, ".undo"));
+}
+
+// Rewrites a file in place from its first change on. The patched content is gathered into
+// chunks which are written front to back. Where content moves towards the end of the file,
+// a chunk overwrites original bytes which are still to be copied further back, so those are
+// saved before the chunk is written.
+typedef struct {
+    int fd;
+    Nob_String_View base;    // the original content, pinned
+    Nob_String_Builder *out; // the chunk
+    size_t pos;              // file offset of the chunk
+    size_t next;             // offset in base of the next original byte to copy
+    Nob_String_Builder *saved;
+    size_t saved_head; // the saved bytes start at saved->items[saved_head]
+    size_t saved_from; // offset in base of the first saved byte
+    uint64_t written;
+} tail_writer;
+
+#define TAIL_CHUNK_SIZE ((size_t)1 << 20)
+
+static bool tail_flush(tail_writer *tw) {
+    size_t end = tw->pos + tw->out->count;
+    size_t saved_to = tw->saved_from + tw->saved->count - tw->saved_head;
+    if (saved_to <= tw->next) {
+        tw->saved->count = 0;
+        tw->saved_head = 0;
+        tw->saved_from = tw->next;
+        saved_to = tw->next;
+    } else {
+        tw->saved_head += tw->next - tw->saved_from;
+        tw->saved_from = tw->next;
+        if (tw->saved_head > tw->saved->count / 2) {
+            memmove(tw->saved->items, tw->saved->items + tw->saved_head, tw->saved->count - tw->saved_head);
+            tw->saved->count -= tw->saved_head;
+            tw->saved_head = 0;
+        }
+    }
+    size_t keep_to = min(end, tw->base.count);
+    if (saved_to < keep_to) {
+        nob_sb_append_buf(tw->saved, tw->base.data + saved_to, keep_to - saved_to);
+    }
+
+    if (!pwrite_all(tw->fd, tw->out->items, tw->out->count, (off_t)tw->pos)) {
+        return false;
+    }
+    tw->written += tw->out->count;
+    tw->pos = end;
+    tw->out->count = 0;
+    return true;
+}
+
+static bool tail_append(tail_writer *tw, const char *data, size_t size) {
+    bool original = data >= tw->base.data && data < tw->base.data + tw->base.count;
+    if (original) {
+        // The matched bytes in between are not copied
+        tw->next = (size_t)(data - tw->base.data);
+    }
+    while (size > 0) {
+        size_t n = min(size, TAIL_CHUNK_SIZE - tw->out->count);
+        if (original) {
+            // Original bytes which were overwritten come from the saved ones
+            size_t saved_to = tw->saved_from + tw->saved->count - tw->saved_head;
+            size_t from_saved = saved_to > tw->next ? min(n, saved_to - tw->next) : 0;
+            nob_sb_append_buf(tw->out, tw->saved->items + tw->saved_head + (tw->next - tw->saved_from), from_saved);
+            nob_sb_append_buf(tw->out, tw->base.data + tw->next + from_saved, n - from_saved);
+            tw->next += n;
+        } else {
+            nob_sb_append_buf(tw->out, data, n);
+        }
+        data += n;
+        size -= n;
+        if (tw->out->count == TAIL_CHUNK_SIZE && !tail_flush(tw)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes the segments after the first change at from into the file and truncates it to
+// the patched size. base is the pinned original. Segments rendered by sequential rules
+// never point into it, so nothing needs to be saved for them.
+bool write_tail(worker *w, int fd, Nob_String_View base, bool from_map, size_t from, uint64_t *written) {
+    tail_writer tw = {.fd = fd, .base = base, .out = &w->chunk, .pos = from, .saved = &w->saved};
+    tw.next = from_map ? from : base.count;
+    w->chunk.count = 0;
+    w->saved.count = 0;
+    size_t offset = 0;
+    size_t size = 0;
+    nob_da_foreach(struct iovec, seg, &w->segs) {
+        const char *data = seg->iov_base;
+        size_t n = seg->iov_len;
+        if (offset < from) {
+            // Everything before the first change stays as it is
+            size_t skip = min(n, from - offset);
+            offset += skip;
+            data += skip;
+            n -= skip;
+        }
+        size += n;
+        if (n > 0 && !tail_append(&tw, data, n)) {
+            return false;
+        }
+    }
+    if (w->chunk.count > 0 && !tail_flush(&tw)) {
+        return false;
+    }
+    *written = tw.written;
+    return ftruncate(fd, (off_t)(from + size)) == 0;
+}
+
+// Writes the segments to path in place. If they point into the mapping of the original,
+// truncating the file would pull the content from under them. The file is then rewritten
+// front to back by write_tail, which saves the original bytes it overwrites while they are
+// still to be copied, and only truncated at the end.
+bool write_segments(worker *w, const char *path, Nob_String_View original, bool in_mapping) {
+#ifdef PATC_IO_URING
+    if (!in_mapping) {
+        bool done;
+        if (!ring_write_file(&w->ring, path, &w->segs, &done) || done) {
+            return done;
+        }
+    }
+#endif // PATC_IO_URING
+    int fd = open(path, in_mapping ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return false;
+    }
+    uint64_t written;
+    bool ok = in_mapping ? write_tail(w, fd, original, true, 0, &written) : writev_all(fd, w->segs.items, w->segs.count);
+    ok = ok && sync_file(fd);
+    int err = errno;
+    if (close(fd) < 0 && ok) {
+        return false;
+    }
+    errno = err;
+    return ok;
+}
+
+// Shifts the content after the block at the first change by the size difference with
+// fallocate, so only the bytes from that block up to the end of the last change are written.
+// The file system has to support inserting and collapsing ranges and the difference has to
+// be a multiple of its block size. Fails with EOPNOTSUPP before changing the file otherwise.
+bool write_shifted(worker *w, int fd, Nob_String_View base, size_t block, uint64_t *written) {
+#ifdef FALLOC_FL_INSERT_RANGE
+    const edit *last = &nob_da_last(&w->es);
+    size_t end = last->offset + last->rule->to_match.count;
+    size_t from = w->es.items[0].offset;
+    int64_t diff = 0;
+    nob_da_foreach(edit, e, &w->es) {
+        diff += (int64_t)e->rule->to_replace.count - (int64_t)e->rule->to_match.count;
+    }
+    size_t shift = (size_t)(diff < 0 ? -diff : diff);
+    if (diff != 0) {
+        from -= from % block;
+        if (shift % block != 0 || (diff < 0 && from + shift >= base.count)) {
+            errno = EOPNOTSUPP;
+            return false;
+        }
+    }
+
+    // The bytes to write are rendered before the shift moves the originals
+    w->chunk.count = 0;
+    size_t i = from;
+    nob_da_foreach(edit, e, &w->es) {
+        nob_sb_append_buf(&w->chunk, base.data + i, e->offset - i);
+        nob_sb_append_buf(&w->chunk, e->rule->to_replace.data, e->rule->to_replace.count);
+        i = e->offset + e->rule->to_match.count;
+    }
+    NOB_ASSERT(i == end);
+
+    int mode = diff > 0 ? FALLOC_FL_INSERT_RANGE : FALLOC_FL_COLLAPSE_RANGE;
+    if (diff != 0 && fallocate(fd, mode, (off_t)from, (off_t)shift) < 0) {
+        return false;
+    }
+    if (!pwrite_all(fd, w->chunk.items, w->chunk.count, (off_t)from)) {
+        return false;
+    }
+    *written = w->chunk.count;
+    return true;
+#else
+    (void)w;
+    (void)fd;
+    (void)base;
+    (void)block;
+    (void)written;
+    errno = EOPNOTSUPP;
+    return false;
+#endif // FALLOC_FL_INSERT_RANGE
+}
+
+// Offset of the first byte in which the patched content differs from the original
+size_t first_change(const segments *segs, Nob_String_View original) {
+    size_t offset = 0;
+    nob_da_foreach(struct iovec, seg, segs) {
+        const char *data = seg->iov_base;
+        size_t n = min(seg->iov_len, original.count - offset);
+        for (size_t i = 0; i < n; ++i) {
+            if (data[i] != original.data[offset + i]) {
+                return offset + i;
+            }
+        }
+        offset += n;
+        if (n < seg->iov_len) {
+            break;
+        }
+    }
+    return offset;
+}
+
+// Writes the patched file without rewriting what comes before its first change. The rest
+// is rewritten in place. In minimal mode, if shifting the rest of the file by the size
+// difference with fallocate leaves less to write, the file is shifted. A change at the
+// start of the file rewrites it whole. The original has to be pinned, when the edits apply
+// to it they locate the first change, otherwise the content rendered by sequential rules
+// is compared to it.
+bool write_partial(target *t, worker *w, const source *src, bool from_map) {
+    Nob_String_View base = src->content;
+    size_t from = from_map ? w->es.items[0].offset : first_change(&w->segs, base);
+    uint64_t size = 0;
+    nob_da_foreach(struct iovec, seg, &w->segs) {
+        size += seg->iov_len;
+    }
+    if (from == 0) {
+        target_log(t, NOB_INFO, "rewriting %s", t->path);
+        t->written = size;
+        return write_segments(w, t->path, base, from_map && src->map != NULL);
+    }
+
+    int fd = open(t->path, O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = false;
+    if (selected_write == WRITE_MINIMAL && from_map) {
+        // Shifting renders the bytes it writes in memory, so it is limited to a chunk
+        const edit *last = &nob_da_last(&w->es);
+        size_t block = (size_t)src->st.st_blksize;
+        size_t shift_from = size == base.count ? from : from - from % block;
+        uint64_t shifted = (uint64_t)last->offset + last->rule->to_match.count + size - base.count - shift_from;
+        if (shifted < size - from && shifted <= TAIL_CHUNK_SIZE) {
+            ok = write_shifted(w, fd, base, block, &t->written);
+            if (ok) {
+                target_log(t, NOB_INFO, "shifted the end of %s and wrote %" PRIu64 " bytes", t->path, t->written);
+            } else if (errno != EOPNOTSUPP && errno != EINVAL) {
+                int err = errno;
+                close(fd);
+                errno = err;
+                return false;
+            }
+        }
+    }
+    if (!ok) {
+        ok = write_tail(w, fd, base, from_map, from, &t->written);
+        if (ok) {
+            target_log(t, NOB_INFO, "rewrote %s from offset %zu, %" PRIu64 " bytes", t->path, from, t->written);
+        }
+    }
+    ok = ok && sync_file(fd);
+    int err = errno;
+    if (close(fd) < 0 && ok) {
+        return false;
+    }
+    errno = err;
+    return ok;
+}
+
+// Backs up the original of the target before the patched file replaces it. Falls back to
+// copying if linking fails, mode is updated to the backup made. hash is the hash of the
+// original for the store.
+bool backup_target(target *t, worker *w, backup_mode *mode, const char *hash) {
+    if (*mode == BACKUP_STORE) {
+        const char *blob = store_blob_path(&w->blob, hash);
+        bool stored;
+        if (!store_blob(w, t->path, blob, &stored)) {
+            target_log(t, NOB_ERROR, "failed to store %s as %s: %s", t->path, blob, strerror(errno));
+            return false;
+        }
+        target_log(t, NOB_INFO, stored ? "storing %s -> %s" : "%s is already stored as %s", t->path, blob);
+        memcpy(t->stored, hash, sizeof(t->stored));
+        return true;
+    }
+
+    const char *backup_path = worker_path(w, t, ".bak");
+    if (*mode == BACKUP_LINK) {
+        target_log(t, NOB_INFO, "linking %s -> %s", t->path, backup_path);
+        if ((unlink(backup_path) < 0 && errno != ENOENT) || link(t->path, backup_path) < 0) {
+            target_log(t, NOB_WARNING, "could not link %s -> %s: %s. Copying instead", t->path, backup_path, strerror(errno));
+            *mode = BACKUP_COPY;
+        }
+    }
+    if (*mode == BACKUP_COPY) {
+        target_log(t, NOB_INFO, "copying %s -> %s", t->path, backup_path);
+        if (!copy_file(t->path, backup_path, selected_durability != DURABILITY_NONE)) {
+            target_log(t, NOB_ERROR, "failed to back up %s: %s", t->path, strerror(errno));
+            return false;
+        }
+    }
+    if (selected_durability != DURABILITY_NONE) {
+        sync_dir(&w->dir, backup_path);
+    }
+    return true;
+}
+
+typedef struct {
+    dev_t *items;
+    size_t count;
+    size_t capacity;
+} devices;
+
+// Flushes every file system a file was written to once. With batched durability this
+// replaces flushing every file on its own.
+void sync_filesystems(const targets *ts) {
+    devices devs = {0};
+    nob_da_foreach(target, t, ts) {
+        if (t->written == 0) {
+            continue;
+        }
+        bool seen = false;
+        nob_da_foreach(dev_t, dev, &devs) {
+            seen = seen || *dev == t->dev;
+        }
+        if (seen) {
+            continue;
+        }
+        nob_da_append(&devs, t->dev);
+#ifdef __linux__
+        int fd = open(t->path, O_RDONLY);
+        if (fd >= 0 && syncfs(fd) == 0) {
+            close(fd);
+            continue;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif // __linux__
+        sync();
+        break;
+    }
+    nob_da_free(devs);
+}
+
+// Renames the files left pending by batched durability over their targets
+bool rename_pending(targets *ts) {
+    bool ok = true;
+    nob_da_foreach(target, t, ts) {
+        if (t->pending == NULL) {
+            continue;
+        }
+        if (rename(t->pending, t->path) < 0) {
+            nob_log(NOB_ERROR, "could not replace %s with %s: %s", t->path, t->pending, strerror(errno));
+            unlink(t->pending);
+            ok = false;
+        }
+        free(t->pending);
+        t->pending = NULL;
+    }
+    return ok;
+}
+
+// A transaction stages the patched files as <file>.patc-new and links the originals to
+// <file>.patc-old. Only once every file is staged are the new files renamed into place. The
+// journal lists the files of the transaction from before anything is staged until the last
+// rename is done, so a journal left behind by a failure or crash means the transaction has
+// to be rolled back, which puts the old files back and removes the staged ones.
+#define JOURNAL_PATH ".patc-journal"
+#define JOURNAL_MAGIC "patc-journal 1\n"
+#define JOURNAL_COMMIT_MAGIC "patc-journal 1 commit\n"
+
+int stage_open(worker *w, const target *t, const struct stat *st) {
+    w->temp.count = 0;
+    nob_sb_appendf(&w->temp, "%s.patc-new", t->path);
+    return open(w->temp.items, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 07777);
+}
+
+// Completes the staged file and keeps the original as <file>.patc-old. Originals which go
+// to the store are stored now, the rest become backups once the transaction is committed.
+bool stage_commit(target *t, worker *w, int fd, const struct stat *st, const char *hash) {
+    bool ok = copy_owner_and_mode(fd, st) && sync_file(fd);
+    if (!ok) {
+        atomic_abort(w, fd, true);
+    } else if (close(fd) < 0) {
+        ok = false;
+    }
+    if (!ok) {
+        target_log(t, NOB_ERROR, "failed to stage patched file %s: %s", w->temp.items, strerror(errno));
+        return false;
+    }
+
+    if (selected_backup == BACKUP_STORE && hash != NULL) {
+        backup_mode mode = BACKUP_STORE;
+        if (!backup_target(t, w, &mode, hash)) {
+            unlink(w->temp.items);
+            return false;
+        }
+    }
+    const char *old_path = worker_path(w, t, ".patc-old");
+    if ((unlink(old_path) < 0 && errno != ENOENT) || (link(t->path, old_path) < 0 && !copy_file(t->path, old_path, selected_durability != DURABILITY_NONE))) {
+        target_log(t, NOB_ERROR, "failed to keep the original of %s: %s", t->path, strerror(errno));
+        unlink(old_path);
+        unlink(w->temp.items);
+        return false;
+    }
+    target_log(t, NOB_INFO, "staged %s", t->path);
+    t->staged = true;
+    return true;
+}
+
+// Stages the patched content of a file which is not streamed
+bool stage_target(target *t, worker *w, const source *src) {
+    if (!S_ISREG(src->st.st_mode)) {
+        target_log(t, NOB_ERROR, "cannot patch %s in a transaction, it is not a regular file", t->path);
+        return false;
+    }
+    int fd = stage_open(w, t, &src->st);
+    if (fd < 0 || !writev_all(fd, w->segs.items, w->segs.count)) {
+        target_log(t, NOB_ERROR, "failed to stage patched file %s: %s", w->temp.items, strerror(errno));
+        if (fd >= 0) {
+            atomic_abort(w, fd, true);
+        }
+        return false;
+    }
+    nob_da_foreach(struct iovec, seg, &w->segs) {
+        t->written += seg->iov_len;
+    }
+    // The buffer of an original read like a pipe may be overwritten by sequential rules by now
+    char hash[65];
+    if (src->pinned) {
+        sha256_hex(src->content.data, src->content.count, hash);
+    }
+    return stage_commit(t, w, fd, &src->st, src->pinned ? hash : NULL);
+}
+
+static bool sync_path(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Writes the journal through a temporary file, so it is never seen half written. A
+// committing journal lists only the staged files, whose originals may have been replaced.
+bool write_journal(const targets *ts, bool committing) {
+    Nob_String_Builder journal = {0};
+    nob_sb_append_cstr(&journal, committing ? JOURNAL_COMMIT_MAGIC : JOURNAL_MAGIC);
+    nob_da_foreach(target, t, ts) {
+        if (!committing || t->staged) {
+            nob_sb_appendf(&journal, "%s\n", t->path);
+        }
+    }
+    bool ok = nob_write_entire_file(JOURNAL_PATH ".tmp", journal.items, journal.count);
+    ok = ok && (selected_durability == DURABILITY_NONE || sync_path(JOURNAL_PATH ".tmp"));
+    ok = ok && rename(JOURNAL_PATH ".tmp", JOURNAL_PATH) == 0;
+    ok = ok && (selected_durability == DURABILITY_NONE || sync_path("."));
+    if (!ok) {
+        nob_log(NOB_ERROR, "could not write journal %s: %s", JOURNAL_PATH, strerror(errno));
+        unlink(JOURNAL_PATH ".tmp");
+    }
+    nob_sb_free(journal);
+    return ok;
+}
+
+// Removes what an earlier run left of the files a transaction is about to stage, so only
+// files staged by this transaction are ever rolled back
+void remove_stale_stages(const targets *ts) {
+    Nob_String_Builder path = {0};
+    nob_da_foreach(target, t, ts) {
+        path.count = 0;
+        nob_sb_appendf(&path, "%s.patc-new", t->path);
+        unlink(path.items);
+        path.count = 0;
+        nob_sb_appendf(&path, "%s.patc-old", t->path);
+        unlink(path.items);
+    }
+    nob_sb_free(path);
+}
+
+// Removes the staged file of path and its original. If the staged file may already have
+// been renamed over path, the original is put back first.
+bool rollback_file(Nob_String_Builder *sb, const char *path, bool replaced) {
+    sb->count = 0;
+    nob_sb_appendf(sb, "%s.patc-old", path);
+    if (replaced) {
+        if (rename(sb->items, path) == 0) {
+            nob_log(NOB_INFO, "rolled back %s", path);
+        } else if (errno != ENOENT) {
+            nob_log(NOB_ERROR, "could not roll back %s: %s", path, strerror(errno));
+            return false;
+        }
+    }
+    // The old file may still be a link to the original, which rename leaves in place
+    unlink(sb->items);
+    sb->count = 0;
+    nob_sb_appendf(sb, "%s.patc-new", path);
+    unlink(sb->items);
+    return true;
+}
+
+// Rolls back the staged files of this run
+bool rollback_transaction(const targets *ts, bool replaced) {
+    bool ok = true;
+    Nob_String_Builder sb = {0};
+    nob_da_foreach(target, t, ts) {
+        if (t->staged) {
+            ok = rollback_file(&sb, t->path, replaced) && ok;
+        }
+    }
+    nob_sb_free(sb);
+    if (ok && unlink(JOURNAL_PATH) < 0 && errno != ENOENT) {
+        nob_log(NOB_ERROR, "could not remove journal %s: %s", JOURNAL_PATH, strerror(errno));
+        ok = false;
+    }
+    return ok;
+}
+
+// Rolls back the files of the journal. While staging only files with a staged file are
+// rolled back and their originals are untouched. While committing every listed file was
+// staged and may have been replaced already.
+bool rollback_journal(void) {
+    Nob_String_Builder journal = {0};
+    if (!read_file(JOURNAL_PATH, &journal)) {
+        nob_log(NOB_ERROR, "could not read journal %s: %s", JOURNAL_PATH, strerror(errno));
+        return false;
+    }
+    Nob_String_View content = nob_sb_to_sv(journal);
+    bool committing = nob_sv_starts_with(content, nob_sv_from_cstr(JOURNAL_COMMIT_MAGIC));
+    if (!committing && !nob_sv_starts_with(content, nob_sv_from_cstr(JOURNAL_MAGIC))) {
+        nob_log(NOB_ERROR, "%s is not a patc journal", JOURNAL_PATH);
+        nob_sb_free(journal);
+        return false;
+    }
+    nob_sv_chop_left(&content, strlen(committing ? JOURNAL_COMMIT_MAGIC : JOURNAL_MAGIC));
+
+    bool ok = true;
+    Nob_String_Builder path = {0};
+    Nob_String_Builder other = {0};
+    while (content.count > 0) {
+        Nob_String_View file = nob_sv_chop_by_delim(&content, '\n');
+        path.count = 0;
+        nob_sb_append_buf(&path, file.data, file.count);
+        nob_sb_append_null(&path);
+        if (!committing) {
+            other.count = 0;
+            nob_sb_appendf(&other, "%s.patc-new", path.items);
+            if (access(other.items, F_OK) < 0) {
+                continue;
+            }
+        }
+        ok = rollback_file(&other, path.items, committing) && ok;
+    }
+    nob_sb_free(path);
+    nob_sb_free(other);
+    nob_sb_free(journal);
+    if (ok && unlink(JOURNAL_PATH) < 0) {
+        nob_log(NOB_ERROR, "could not remove journal %s: %s", JOURNAL_PATH, strerror(errno));
+        ok = false;
+    }
+    return ok;
+}
+
+// Rolls back a transaction a crash left behind. With --nowrite nothing is changed, the
+// journal is only reported.
+void recover_transaction(void) {
+    if (access(JOURNAL_PATH, F_OK) < 0) {
+        return;
+    }
+    if (nowrite) {
+        nob_log(NOB_WARNING, "found journal %s of an interrupted transaction, it is rolled back by the next run without --nowrite", JOURNAL_PATH);
+        return;
+    }
+    nob_log(NOB_WARNING, "found journal %s of an interrupted transaction, rolling it back", JOURNAL_PATH);
+    if (!rollback_journal()) {
+        exit(1);
+    }
+}
+
+// Renames the staged files into place if every file was staged, the originals become the
+// backups. Rolls the transaction back otherwise.
+bool commit_transaction(targets *ts, bool staged) {
+    bool ok = staged;
+    if (ok && selected_durability == DURABILITY_BATCH) {
+        sync_filesystems(ts);
+    }
+    bool committing = ok && write_journal(ts, true);
+    ok = committing;
+    Nob_String_Builder path = {0};
+    for (size_t i = 0; ok && i < ts->count; ++i) {
+        target *t = &ts->items[i];
+        if (!t->staged) {
+            continue;
+        }
+        path.count = 0;
+        nob_sb_appendf(&path, "%s.patc-new", t->path);
+        if (rename(path.items, t->path) < 0) {
+            nob_log(NOB_ERROR, "could not commit %s: %s", t->path, strerror(errno));
+            ok = false;
+        }
+    }
+    if (ok && selected_durability != DURABILITY_NONE) {
+        sync_filesystems(ts);
+    }
+    if (!ok || unlink(JOURNAL_PATH) < 0) {
+        nob_log(NOB_ERROR, "rolling back the transaction");
+        rollback_transaction(ts, committing);
+        nob_da_foreach(target, t, ts) {
+            t->stored[0] = '\0';
+        }
+        nob_sb_free(path);
+        return false;
+    }
+
+    Nob_String_Builder backup_path = {0};
+    nob_da_foreach(target, t, ts) {
+        if (!t->staged) {
+            continue;
+        }
+        path.count = 0;
+        nob_sb_appendf(&path, "%s.patc-old", t->path);
+        backup_path.count = 0;
+        nob_sb_appendf(&backup_path, "%s.bak", t->path);
+        if (t->stored[0] != '\0' || selected_backup == BACKUP_NONE) {
+            unlink(path.items);
+        } else if (rename(path.items, backup_path.items) < 0) {
+            nob_log(NOB_WARNING, "could not keep the original of %s as backup: %s", t->path, strerror(errno));
+        }
+    }
+    nob_sb_free(path);
+    nob_sb_free(backup_path);
+    return true;
+}
+
+void append_output(target *t, const segments *segs) {
+    nob_da_foreach(struct iovec, seg, segs) {
+        nob_sb_append_buf(&t->output, seg->iov_base, seg->iov_len);
+    }
+}
+
+#define STREAM_CHUNK_SIZE ((size_t)8 << 20) // without --max-memory
+
+// Patches the file a chunk at a time into a new file which is renamed over it once
+// complete, so the file is never held in memory as a whole. The last max pattern length - 1
+// bytes of a chunk are kept and patched together with the next chunk, since a match starting
+// there may continue in it. A match starting before them ends within the chunk. The chunk
+// and the kept bytes together take --max-memory. With --nowrite the patched content is
+// collected in the output of the target regardless.
+bool stream_target(target *t, worker *w, source *src) {
+    int out = -1;
+    bool named = false;
+    if (nowrite) {
+        nob_sb_appendf(&t->output, "File %s after patching:\n", t->path);
+    } else {
+        if (transaction) {
+            out = stage_open(w, t, &src->st);
+            named = true;
+        } else {
+            out = atomic_open(w, t->path, &src->st, &named);
+        }
+        if (out < 0) {
+            target_log(t, NOB_ERROR, "failed to create the patched file for %s: %s", t->path, strerror(errno));
+            return false;
+        }
+    }
+
+    size_t overlap = 0;
+    for (size_t i = 0; i < t->count; ++i) {
+        if (t->items[i]->to_match.count > overlap + 1) {
+            overlap = t->items[i]->to_match.count - 1;
+        }
+    }
+    if (t->count > 1) {
+        ac_build(&w->ac, t);
+    }
+    sha256 hash;
+    sha256_init(&hash);
+
+    Nob_String_Builder *buf = &w->front;
+    buf->count = 0;
+    size_t window = max_memory > 0 ? max_memory : STREAM_CHUNK_SIZE + overlap;
+    nob_da_reserve(buf, window);
+    bool eof = false;
+    bool ok = true;
+    uint64_t read_to = 0;
+    uint64_t consumed = 0;  // bytes of the original which are no longer needed
+    uint64_t dropped = 0;   // written bytes before are dropped from the page cache
+    uint64_t flushing = 0;  // written bytes before are on their way to disk
+    while (ok) {
+        while (!eof && buf->count < window) {
+            ssize_t n = read(src->fd, buf->items + buf->count, window - buf->count);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ok = false;
+                break;
+            }
+            eof = n == 0;
+            sha256_update(&hash, buf->items + buf->count, (size_t)n);
+            buf->count += (size_t)n;
+            read_to += (uint64_t)n;
+        }
+        if (!ok) {
+            break;
+        }
+        // Read the next window while this one is matched, the kernel reads ahead far less
+        if (!eof) {
+            posix_fadvise(src->fd, (off_t)read_to, (off_t)window, POSIX_FADV_WILLNEED);
+        }
+
+        w->es.count = 0;
+        if (t->count == 1) {
+            find_edits(t->items[0], buf->items, buf->count, &w->es);
+        } else {
+            ac_find_edits(&w->ac, buf->items, buf->count, &w->es);
+        }
+        size_t end = eof ? buf->count : buf->count - overlap;
+        size_t keep = 0;
+        while (keep < w->es.count && w->es.items[keep].offset < end) {
+            keep++;
+        }
+        w->es.count = keep;
+        if (keep > 0) {
+            const edit *last = &w->es.items[keep - 1];
+            end = last->offset + last->rule->to_match.count > end ? last->offset + last->rule->to_match.count : end;
+        }
+        t->matches += keep;
+
+        collect_segments(nob_sv_from_parts(buf->items, end), &w->es, &w->segs);
+        if (nowrite) {
+            append_output(t, &w->segs);
+        } else {
+            nob_da_foreach(struct iovec, seg, &w->segs) {
+                t->written += seg->iov_len;
+            }
+            ok = writev_all(out, w->segs.items, w->segs.count);
+        }
+        if (ok && drop_cache) {
+            // The original is read once, and the previous window written is on disk by the
+            // time this one is, so neither has to stay in the page cache
+            if (read_to - (buf->count - end) > consumed) {
+                posix_fadvise(src->fd, (off_t)consumed, (off_t)(read_to - (buf->count - end) - consumed), POSIX_FADV_DONTNEED);
+                consumed = read_to - (buf->count - end);
+            }
+            if (!nowrite && t->written > flushing) {
+                if (flushing > dropped) {
+                    drop_written(out, (off_t)dropped, (off_t)(flushing - dropped));
+                    dropped = flushing;
+                }
+#ifdef __linux__
+                sync_file_range(out, (off_t)flushing, (off_t)(t->written - flushing), SYNC_FILE_RANGE_WRITE);
+#endif // __linux__
+                flushing = t->written;
+            }
+        }
+        if (eof) {
+            break;
+        }
+        memmove(buf->items, buf->items + end, buf->count - end);
+        buf->count -= end;
+    }
+    if (!ok) {
+        target_log(t, NOB_ERROR, "failed to patch file %s: %s", t->path, strerror(errno));
+        if (!nowrite) {
+            atomic_abort(w, out, named);
+        }
+        return false;
+    }
+
+    for (size_t i = 0; i < t->count; ++i) {
+        if (t->count == 1 ? t->matches == 0 : w->ac.hits[i] == 0) {
+            warn_no_match(t, t->items[i]);
+        }
+    }
+    if (nowrite) {
+        nob_da_append(&t->output, '\n');
+        return true;
+    }
+    if (t->matches == 0) {
+        target_log(t, NOB_INFO, "File %s is unchanged", t->path);
+        atomic_abort(w, out, named);
+        return true;
+    }
+
+    char hex[65];
+    sha256_final(&hash, hex);
+    if (transaction) {
+        return stage_commit(t, w, out, &src->st, hex);
+    }
+    backup_mode mode = selected_backup;
+    if (!backup_target(t, w, &mode, hex)) {
+        atomic_abort(w, out, named);
+        return false;
+    }
+    if (!atomic_commit(t, w, out, named, &src->st)) {
+        target_log(t, NOB_ERROR, "failed to write patched file %s: %s", t->path, strerror(errno));
+        return false;
+    }
+    drop_undo(t, w);
+    return true;
+}
+
+// Opens the file of a target. A file which is streamed is left open as src->fd.
+bool read_target(target *t, worker *w, source *src) {
+    // Sequential rules see the output of the rules before, which needs the whole file
+    bool can_stream = !sequential || t->count == 1;
+    // Writing in place maps the file whatever its size. It only writes the changed bytes, or
+    // the bytes from the first change on a chunk at a time, so streaming would only write more.
+    bool in_place = selected_write != WRITE_REWRITE;
+    uint64_t stream_from = UINT64_MAX;
+    if (in_place) {
+        can_stream = false;
+    } else if (can_stream && stream) {
+        stream_from = 0;
+    } else if (can_stream && max_memory > 0) {
+        stream_from = (uint64_t)max_memory + 1;
+    }
+    if (!source_open(src, w, t->path, can_stream, stream_from)) {
+        target_log(t, NOB_ERROR, "failed to read file to patch %s: %s", t->path, strerror(errno));
+        return false;
+    }
+
+    target_log(t, NOB_INFO, "Patching file %s", t->path);
+    t->dev = src->st.st_dev;
+    size_t next = __atomic_load_n(w->cursor, __ATOMIC_RELAXED);
+    if (next < w->queue->count) {
+        prefetch_file(w, w->queue->items[next].path);
+    }
+    if (!can_stream && !in_place && src->fd < 0 && (stream || (max_memory > 0 && (uint64_t)src->st.st_size > max_memory))) {
+        target_log(t, NOB_WARNING, "cannot stream %s through several rules with --sequential, reading it whole", t->path);
+    }
+    return true;
+}
+
+// Finds the edits of the rules in a target. A streamed file is also written here, a window
+// at a time.
+bool match_target(target *t, worker *w, source *src) {
+    if (src->fd >= 0) {
+        return stream_target(t, w, src);
+    }
+    patch_target(t, w, src->content);
+    collect_segments(w->base, &w->es, &w->segs);
+    return true;
+}
+
+// Backs up and writes a patched file which was not streamed
+bool write_target(target *t, worker *w, source *src) {
+    if (src->fd >= 0) {
+        return true;
+    }
+    if (nowrite) {
+        nob_sb_appendf(&t->output, "File %s after patching:\n", t->path);
+        append_output(t, &w->segs);
+        nob_da_append(&t->output, '\n');
+        return true;
+    }
+
+    // Neither back up nor rewrite a file without matches, which keeps its mtime intact.
+    // The content may also still point into the mapping of the file.
+    if (t->matches == 0) {
+        target_log(t, NOB_INFO, "File %s is unchanged", t->path);
+        return true;
+    }
+    if (transaction) {
+        return stage_target(t, w, src);
+    }
+
+    // Patching in place needs the edits to apply to the original, which they do not in
+    // sequential mode once an earlier rule matched
+    bool regular = S_ISREG(src->st.st_mode);
+    if (selected_write == WRITE_INPLACE) {
+        if (regular && w->base.data == src->content.data && edits_keep_size(&w->es)) {
+            return patch_in_place(t, w, src->content, &src->st);
+        }
+        target_log(t, NOB_INFO, "cannot patch %s in place, rewriting it", t->path);
+    }
+
+    // Linking the original as backup is only possible if the patched file gets a new inode.
+    // Anything but a regular file is backed up by copying. The store hashes the original
+    // while it is still pinned, the buffer of a file read like a pipe may be overwritten by now.
+    backup_mode mode = selected_backup;
+    if ((mode == BACKUP_LINK && !regular) || (mode == BACKUP_STORE && !src->pinned)) {
+        mode = BACKUP_COPY;
+    }
+    char hash[65] = {0};
+    if (mode == BACKUP_STORE) {
+        sha256_hex(src->content.data, src->content.count, hash);
+    }
+    if (!backup_target(t, w, &mode, hash)) {
+        return false;
+    }
+
+    // Writing less than the whole file needs the original to compare to. The original inode
+    // is the backup in link mode and must not change.
+    bool written;
+    bool from_map = src->pinned && w->base.data == src->content.data;
+    bool partial = selected_write == WRITE_TAIL || selected_write == WRITE_MINIMAL;
+    if (partial && mode != BACKUP_LINK && src->pinned) {
+        written = write_partial(t, w, src, from_map);
+    } else {
+        nob_da_foreach(struct iovec, seg, &w->segs) {
+            t->written += seg->iov_len;
+        }
+        if ((atomic || mode == BACKUP_LINK) && regular) {
+            written = write_atomic(t, w, &src->st);
+        } else {
+            written = write_segments(w, t->path, src->content, from_map && src->map != NULL);
+        }
+    }
+    if (!written) {
+        target_log(t, NOB_ERROR, "failed to write patched file %s: %s", t->path, strerror(errno));
+        return false;
+    }
+    drop_undo(t, w);
+    return true;
+}
+
+bool process_target(target *t, worker *w) {
+    source src;
+    bool ok = read_target(t, w, &src) && match_target(t, w, &src) && write_target(t, w, &src);
+    source_close(&src);
+    return ok;
+}
+
+// Targets are handed out through a shared cursor, so an idle worker always takes the next
+// unclaimed target. The main thread prints the logs in target order as targets finish.
+typedef struct {
+    targets *ts;
+    bool (*process)(target *t, worker *w);
+    bool stop_on_failure;
+    size_t next;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t target_done;
+} target_pool;
+
+void worker_init(worker *w, target_pool *pool) {
+    memset(w, 0, sizeof(*w));
+    w->queue = pool->ts;
+    w->cursor = &pool->next;
+    w->ring.fd = -1;
+    if (selected_io == IO_URING) {
+        ring_setup(&w->ring);
+    }
+}
+
+void worker_free(worker *w) {
+    nob_sb_free(w->front);
+    nob_sb_free(w->back);
+    nob_da_free(w->es);
+    nob_da_free(w->ac);
+    free(w->ac.hits);
+    nob_da_free(w->segs);
+    nob_sb_free(w->dir);
+    nob_sb_free(w->path);
+    nob_sb_free(w->temp);
+    nob_sb_free(w->blob);
+    nob_da_free(w->changes);
+    nob_sb_free(w->chunk);
+    nob_sb_free(w->saved);
+    nob_sb_free(w->input);
+    ring_free(&w->ring);
+}
+
+// After a failure the remaining targets are left untouched if the pool stops on failure
+static bool pool_stopped(target_pool *pool) {
+    return pool->stop_on_failure && __atomic_load_n(&pool->failed, __ATOMIC_RELAXED);
+}
+
+// Hands a processed target to the main thread for printing
+void finish_target(target_pool *pool, target *t, bool ok) {
+    if (!ok) {
+        t->failed = true;
+        __atomic_store_n(&pool->failed, true, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&pool->lock);
+    t->done = true;
+    pthread_cond_broadcast(&pool->target_done);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *target_worker(void *arg) {
+    target_pool *pool = arg;
+    worker w;
+    worker_init(&w, pool);
+    while (true) {
+        size_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= pool->ts->count) {
+            break;
+        }
+        target *t = &pool->ts->items[i];
+        finish_target(pool, t, pool_stopped(pool) || pool->process(t, &w));
+    }
+    worker_free(&w);
+    return NULL;
+}
+
+// Prints the logs and output of the targets in target order as they finish
+void print_targets(target_pool *pool) {
+    nob_da_foreach(target, t, pool->ts) {
+        pthread_mutex_lock(&pool->lock);
+        while (!t->done) {
+            pthread_cond_wait(&pool->target_done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        fwrite(t->log.items, 1, t->log.count, stderr);
+        fwrite(t->output.items, 1, t->output.count, stdout);
+        nob_sb_free(t->log);
+        nob_sb_free(t->output);
+    }
+}
+
+// Number of --jobs threads worth starting for the targets
+static size_t job_count(const targets *ts) {
+    if (jobs < 0) {
+        report_error("--jobs must not be negative, got %ld", jobs);
+    }
+    size_t workers = jobs > 0 ? (size_t)jobs : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    workers = min(workers, ts->count);
+    return workers == 0 ? 1 : workers;
+}
+
+// Processes the targets on --jobs threads and prints their logs and output in target order.
+// Returns false if processing any target failed.
+bool run_targets(targets *ts, bool (*process)(target *t, worker *w), bool stop_on_failure) {
+    size_t workers = job_count(ts);
+    target_pool pool = {.ts = ts, .process = process, .stop_on_failure = stop_on_failure};
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.target_done, NULL);
+    pthread_t *threads = NOB_REALLOC(NULL, workers * sizeof(*threads));
+    NOB_ASSERT(threads != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < workers; ++i) {
+        int err = pthread_create(&threads[i], NULL, target_worker, &pool);
+        if (err != 0) {
+            report_error("failed to start worker thread: %s", strerror(err));
+        }
+    }
+
+    print_targets(&pool);
+
+    for (size_t i = 0; i < workers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    NOB_FREE(threads);
+    pthread_cond_destroy(&pool.target_done);
+    pthread_mutex_destroy(&pool.lock);
+    return !pool.failed;
+}
+
+// A target on its way through the pipeline, with the scratch state every stage works in
+typedef struct {
+    worker w;
+    target *t;
+    source src;
+    bool skip; // left untouched after an earlier failure
+    bool ok;
+} pipeline_slot;
+
+// Bounded queue of slots handed from one stage of the pipeline to the next
+typedef struct {
+    pipeline_slot **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    bool closed; // the stage before is done, popping an empty queue returns NULL
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} slot_queue;
+
+void slot_queue_init(slot_queue *q, size_t capacity) {
+    memset(q, 0, sizeof(*q));
+    q->items = NOB_REALLOC(NULL, capacity * sizeof(*q->items));
+    NOB_ASSERT(q->items != NULL && "Buy more RAM lol");
+    q->capacity = capacity;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+}
+
+void slot_queue_free(slot_queue *q) {
+    NOB_FREE(q->items);
+    pthread_cond_destroy(&q->changed);
+    pthread_mutex_destroy(&q->lock);
+}
+
+void slot_queue_push(slot_queue *q, pipeline_slot *slot) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity) {
+        pthread_cond_wait(&q->changed, &q->lock);
+    }
+    q->items[(q->head + q->count) % q->capacity] = slot;
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+pipeline_slot *slot_queue_pop(slot_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->changed, &q->lock);
+    }
+    pipeline_slot *slot = NULL;
+    if (q->count > 0) {
+        slot = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return slot;
+}
+
+void slot_queue_close(slot_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Slots go round from the reader to the matchers to the writer and back to the reader
+typedef struct {
+    target_pool pool;
+    slot_queue empty;   // slots the reader fills next
+    slot_queue read;    // slots waiting for a matcher
+    slot_queue matched; // slots waiting for the writer
+    size_t matchers;    // matchers still running, the last one to finish closes matched
+} pipeline;
+
+void *pipeline_reader(void *arg) {
+    pipeline *p = arg;
+    while (true) {
+        size_t i = __atomic_fetch_add(&p->pool.next, 1, __ATOMIC_RELAXED);
+        if (i >= p->pool.ts->count) {
+            break;
+        }
+        pipeline_slot *slot = slot_queue_pop(&p->empty);
+        slot->t = &p->pool.ts->items[i];
+        slot->skip = pool_stopped(&p->pool);
+        slot->ok = slot->skip || read_target(slot->t, &slot->w, &slot->src);
+        // Mapping a file reads nothing yet. Faulting its pages in here keeps the matcher
+        // from waiting for the disk.
+        if (!slot->skip && slot->ok && slot->src.map != NULL) {
+            bool populated = false;
+#ifdef MADV_POPULATE_READ
+            populated = madvise(slot->src.map, slot->src.map_size, MADV_POPULATE_READ) == 0;
+#endif // MADV_POPULATE_READ
+            if (!populated) {
+                madvise(slot->src.map, slot->src.map_size, MADV_WILLNEED);
+            }
+        }
+        slot_queue_push(&p->read, slot);
+    }
+    slot_queue_close(&p->read);
+    return NULL;
+}
+
+void *pipeline_matcher(void *arg) {
+    pipeline *p = arg;
+    pipeline_slot *slot;
+    while ((slot = slot_queue_pop(&p->read)) != NULL) {
+        if (!slot->skip && slot->ok) {
+            slot->ok = match_target(slot->t, &slot->w, &slot->src);
+        }
+        slot_queue_push(&p->matched, slot);
+    }
+    if (__atomic_sub_fetch(&p->matchers, 1, __ATOMIC_ACQ_REL) == 0) {
+        slot_queue_close(&p->matched);
+    }
+    return NULL;
+}
+
+void *pipeline_writer(void *arg) {
+    pipeline *p = arg;
+    pipeline_slot *slot;
+    while ((slot = slot_queue_pop(&p->matched)) != NULL) {
+        if (!slot->skip && slot->ok) {
+            slot->ok = write_target(slot->t, &slot->w, &slot->src);
+        }
+        source_close(&slot->src);
+        finish_target(&p->pool, slot->t, slot->ok);
+        slot_queue_push(&p->empty, slot);
+    }
+    return NULL;
+}
+
+// Patches the targets in a pipeline of a reader thread, --jobs matcher threads and a writer
+// thread. Up to --queue-depth targets are between reading and writing at any time. Returns
+// false if patching any target failed.
+bool run_pipeline(targets *ts) {
+    size_t depth = (size_t)queue_depth;
+    pipeline p = {.pool = {.ts = ts, .stop_on_failure = true}, .matchers = job_count(ts)};
+    pthread_mutex_init(&p.pool.lock, NULL);
+    pthread_cond_init(&p.pool.target_done, NULL);
+    slot_queue_init(&p.empty, depth);
+    slot_queue_init(&p.read, depth);
+    slot_queue_init(&p.matched, depth);
+    pipeline_slot *slots = NOB_REALLOC(NULL, depth * sizeof(*slots));
+    NOB_ASSERT(slots != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < depth; ++i) {
+        worker_init(&slots[i].w, &p.pool);
+        slots[i].src.fd = -1;
+        slot_queue_push(&p.empty, &slots[i]);
+    }
+
+    size_t count = p.matchers + 2;
+    pthread_t *threads = NOB_REALLOC(NULL, count * sizeof(*threads));
+    NOB_ASSERT(threads != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < count; ++i) {
+        void *(*stage)(void *) = i == 0 ? pipeline_reader : i == 1 ? pipeline_writer : pipeline_matcher;
+        int err = pthread_create(&threads[i], NULL, stage, &p);
+        if (err != 0) {
+            report_error("failed to start pipeline thread: %s", strerror(err));
+        }
+    }
+
+    print_targets(&p.pool);
+
+    for (size_t i = 0; i < count; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    NOB_FREE(threads);
+    for (size_t i = 0; i < depth; ++i) {
+        worker_free(&slots[i].w);
+    }
+    NOB_FREE(slots);
+    slot_queue_free(&p.empty);
+    slot_queue_free(&p.read);
+    slot_queue_free(&p.matched);
+    pthread_cond_destroy(&p.pool.target_done);
+    pthread_mutex_destroy(&p.pool.lock);
+    return !p.pool.failed;
+}
+
+void run_patch(patches *ps) {
+    targets ts = {0};
+
+    select_write_mode();
+    select_durability();
+    select_io();
+    if (atomic && selected_write != WRITE_REWRITE) {
+        report_error("--atomic cannot be combined with --write %s", write_arg);
+    }
+    if (transaction && selected_write != WRITE_REWRITE) {
+        report_error("--transaction cannot be combined with --write %s", write_arg);
+    }
+    if (queue_depth < 0) {
+        report_error("--queue-depth must not be negative, got %ld", queue_depth);
+    }
+    if (selected_backup == BACKUP_STORE && !nowrite && !nob_mkdir_if_not_exists(store)) {
+        exit(1);
+    }
+
+    select_max_memory();
+    select_match_isa(scalar);
+    for (size_t i = 0; i < ps->count; ++i) {
+        matcher_init(&ps->items[i].matcher, ps->items[i].to_match);
+        // A chunk has to fit the bytes kept for the next chunk and a full match after them
+        if (max_memory > 0 && max_memory / 2 < ps->items[i].to_match.count) {
+            report_error("--max-memory %s is less than twice the longest pattern of %zu bytes", max_memory_arg, ps->items[i].to_match.count);
+        }
+    }
+    collect_targets(ps, &ts);
+    nob_da_foreach(target, t, &ts) {
+        t->path = nob_temp_sv_to_cstr(t->filename);
+    }
+    merge_aliases(&ts);
+
+    bool in_transaction = transaction && !nowrite;
+    if (in_transaction) {
+        remove_stale_stages(&ts);
+        if (!write_journal(&ts, false)) {
+            exit(1);
+        }
+    }
+    bool ok = queue_depth > 0 ? run_pipeline(&ts) : run_targets(&ts, process_target, true);
+    if (in_transaction) {
+        ok = commit_transaction(&ts, ok);
+    } else if (selected_durability == DURABILITY_BATCH) {
+        sync_filesystems(&ts);
+        ok = rename_pending(&ts) && ok;
+        sync_filesystems(&ts);
+    }
+
+    // Also record the originals stored before a failure, they are needed to restore
+    if (selected_backup == BACKUP_STORE && !nowrite && !update_manifest(&ts)) {
+        exit(1);
+    }
+    if (!ok) {
+        exit(1);
+    }
+    size_t unchanged = 0;
+    uint64_t written = 0;
+    nob_da_foreach(target, t, &ts) {
+        if (t->matches == 0) {
+            unchanged++;
+        }
+        written += t->written;
+    }
+    nob_log(NOB_INFO, "Patched %zu files, %zu unchanged, wrote %" PRIu64 " bytes", ts.count - unchanged, unchanged, written);
+}
+
+bool restore_target(target *t, worker *w) {
+    // A file patched in place is restored from its undo log, whatever the backup mode
+    const char *undo_path = worker_path(w, t, ".undo");
+    if (access(undo_path, F_OK) == 0) {
+        target_log(t, NOB_INFO, "undoing %s -> %s", undo_path, t->path);
+        if (!apply_undo(undo_path, t->path)) {
+            target_log(t, NOB_ERROR, "Could not restore %s: %s", t->path, strerror(errno));
+            return false;
+        }
+        unlink(undo_path);
+        return true;
+    }
+
+    const char *backup_path;
+    if (selected_backup == BACKUP_STORE) {
+        backup_path = t->stored[0] == '\0' ? NULL : store_blob_path(&w->blob, t->stored);
+    } else {
+        backup_path = worker_path(w, t, ".bak");
+    }
+    if (backup_path == NULL || (access(backup_path, F_OK) < 0 && errno == ENOENT)) {
+        target_log(t, NOB_WARNING, "No backup of %s", t->path);
+        t->missing = true;
+        return true;
+    }
+
+    if (selected_backup == BACKUP_LINK) {
+        // The backup is the original inode, moving it back is all it takes
+        target_log(t, NOB_INFO, "renaming %s -> %s", backup_path, t->path);
+        if (rename(backup_path, t->path) < 0) {
+            target_log(t, NOB_ERROR, "Could not restore %s: %s", t->path, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+    target_log(t, NOB_INFO, "copying %s -> %s", backup_path, t->path);
+    if (!copy_file(backup_path, t->path, false)) {
+        target_log(t, NOB_ERROR, "Could not restore %s: %s", t->path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void run_restore(patches *ps) {
+    targets ts = {0};
+    collect_targets(ps, &ts);
+    nob_da_foreach(target, t, &ts) {
+        t->path = nob_temp_sv_to_cstr(t->filename);
+    }
+    merge_aliases(&ts);
+
+    // Files with the same original share its blob
+    if (selected_backup == BACKUP_STORE) {
+        const char *manifest_path = nob_temp_sprintf("%s/manifest", store);
+        Nob_String_Builder manifest = {0};
+        targets entries = {0};
+        if (!read_manifest(manifest_path, &manifest, &entries)) {
+            nob_log(NOB_ERROR, "could not read manifest %s: %s", manifest_path, strerror(errno));
+            exit(1);
+        }
+        nob_da_foreach(target, e, &entries) {
+            target *t = targets_find(&ts, e->filename);
+            if (t != NULL) {
+                memcpy(t->stored, e->stored, sizeof(e->stored));
+            }
+        }
+        targets_free(&entries);
+        nob_sb_free(manifest);
+    }
+
+    run_targets(&ts, restore_target, false);
+
+    size_t missing = 0;
+    size_t failed = 0;
+    nob_da_foreach(target, t, &ts) {
+        missing += t->missing;
+        failed += t->failed;
+    }
+    nob_log(NOB_INFO, "Restored %zu files, %zu without backup, %zu failed", ts.count - missing - failed, missing, failed);
+    if (failed > 0) {
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *cmd = ccli_parse_opts(commands, options, argc, argv, NULL);
+
+    Nob_String_Builder frdr = {0};
+    if (!read_file(patch_file, &frdr)) {
+        nob_log(NOB_ERROR, "Could not read file %s: %s", patch_file, strerror(errno));
+        return 1;
+    }
+
+    parser p = {
+        .filename = patch_file,
+        .input = frdr.items,
+        .cursor = frdr.items,
+        .len = frdr.count};
+    patches ps = {0};
+    parse_file(&p, &ps);
+    select_backup_mode();
+    if (strcmp(cmd, "check") != 0) {
+        recover_transaction();
+    }
 
     if (strcmp(cmd, "apply") == 0) {
         run_patch(&ps);